@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dircache.h"
+
+// FNV-1a over the (at most 30 character) name
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t block_hash(uint32_t block) {
+    return block * 2654435761u;
+}
+
+int dircache_init(struct dir_cache *cache) {
+    cache->mask = 63;
+    cache->count = 0;
+    cache->dirs = malloc((cache->mask + 1) * sizeof(struct cached_dir));
+    if (!cache->dirs) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    for (size_t i = 0; i <= cache->mask; i++) {
+        memset(&cache->dirs[i], 0, sizeof(struct cached_dir));
+        cache->dirs[i].start_block = FAT_EOF;
+    }
+    return 0;
+}
+
+void dircache_free(struct dir_cache *cache) {
+    for (size_t i = 0; cache->dirs && i <= cache->mask; i++) {
+        free(cache->dirs[i].slots);
+    }
+    free(cache->dirs);
+    cache->dirs = NULL;
+    cache->mask = cache->count = 0;
+}
+
+static struct cached_dir *find_dir(struct dir_cache *cache, uint32_t start_block) {
+    size_t i = block_hash(start_block) & cache->mask;
+    while (cache->dirs[i].start_block != FAT_EOF) {
+        if (cache->dirs[i].start_block == start_block) {
+            return &cache->dirs[i];
+        }
+        i = (i + 1) & cache->mask;
+    }
+    return NULL;
+}
+
+static struct cached_dir *add_dir(struct dir_cache *cache, uint32_t start_block) {
+    // Keep the table at most half full
+    if ((cache->count + 1) * 2 > cache->mask + 1) {
+        size_t old_mask = cache->mask;
+        struct cached_dir *old = cache->dirs;
+        size_t mask = old_mask * 2 + 1;
+        struct cached_dir *dirs = malloc((mask + 1) * sizeof(struct cached_dir));
+        if (!dirs) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        for (size_t i = 0; i <= mask; i++) {
+            memset(&dirs[i], 0, sizeof(struct cached_dir));
+            dirs[i].start_block = FAT_EOF;
+        }
+        for (size_t i = 0; i <= old_mask; i++) {
+            if (old[i].start_block == FAT_EOF) {
+                continue;
+            }
+            size_t j = block_hash(old[i].start_block) & mask;
+            while (dirs[j].start_block != FAT_EOF) {
+                j = (j + 1) & mask;
+            }
+            dirs[j] = old[i];
+        }
+        free(old);
+        cache->dirs = dirs;
+        cache->mask = mask;
+    }
+
+    size_t i = block_hash(start_block) & cache->mask;
+    while (cache->dirs[i].start_block != FAT_EOF) {
+        i = (i + 1) & cache->mask;
+    }
+    cache->dirs[i].start_block = start_block;
+    cache->count++;
+    return &cache->dirs[i];
+}
+
+static void place_name(const struct dir_entry_t **slots, uint32_t mask, const struct dir_entry_t *entry) {
+    uint32_t i = name_hash(entry->filename, entry_name_len(entry)) & mask;
+    while (slots[i]) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = entry;
+}
+
+// Function to add a name to a loaded directory; the first file and the first
+// directory with a given name win, as they do for a linear scan
+static int insert_name(struct cached_dir *dir, const struct dir_entry_t *entry) {
+    uint32_t i = name_hash(entry->filename, entry_name_len(entry)) & dir->mask;
+    while (dir->slots[i]) {
+        const struct dir_entry_t *other = dir->slots[i];
+        if (entry_is_dir(other) == entry_is_dir(entry) && entry_name_len(other) == entry_name_len(entry) &&
+            memcmp(other->filename, entry->filename, entry_name_len(entry)) == 0) {
+            return 0;
+        }
+        i = (i + 1) & dir->mask;
+    }
+
+    if ((dir->count + 1) * 2 > dir->mask + 1) {
+        uint32_t mask = dir->mask * 2 + 1;
+        const struct dir_entry_t **slots = calloc((size_t)mask + 1, sizeof(*slots));
+        if (!slots) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        for (uint32_t j = 0; j <= dir->mask; j++) {
+            if (dir->slots[j]) {
+                place_name(slots, mask, dir->slots[j]);
+            }
+        }
+        free(dir->slots);
+        dir->slots = slots;
+        dir->mask = mask;
+    }
+
+    place_name(dir->slots, dir->mask, entry);
+    dir->count++;
+    return 0;
+}
+
+// Function to build the name table for a directory from its entries
+static int load_dir(struct cached_dir *dir, const struct disk_image *img,
+                    uint32_t start_block, uint32_t block_count) {
+    uint32_t mask = 15;
+    uint64_t nentries = (uint64_t)block_count * img->sb.block_size / DIRECTORY_ENTRY_SIZE;
+    while ((uint64_t)mask + 1 < nentries * 2 && mask < (1u << 30)) {
+        mask = mask * 2 + 1;
+    }
+
+    free(dir->slots);
+    dir->slots = calloc((size_t)mask + 1, sizeof(*dir->slots));
+    if (!dir->slots) {
+        perror("Memory allocation failed");
+        dir->mask = 0;
+        return -1;
+    }
+    dir->mask = mask;
+    dir->count = 0;
+    dir->block_count = block_count;
+    dir_iter_init(&dir->free_hint, img, start_block, block_count);
+
+    struct dir_iter it;
+    const struct dir_entry_t *entry;
+    dir_iter_init(&it, img, start_block, block_count);
+    while ((entry = dir_iter_next(&it))) {
+        if (entry_in_use(entry) && insert_name(dir, entry) < 0) {
+            free(dir->slots);
+            dir->slots = NULL;
+            dir->mask = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to find, or load, the cached directory at start_block
+static struct cached_dir *get_dir(struct dir_cache *cache, const struct disk_image *img,
+                                  uint32_t start_block, uint32_t block_count) {
+    struct cached_dir *dir = find_dir(cache, start_block);
+    if (!dir) {
+        dir = add_dir(cache, start_block);
+        if (!dir) {
+            return NULL;
+        }
+    }
+
+    // Load on first touch, and again if the directory changed size
+    if (dir->mask == 0 || dir->block_count != block_count) {
+        if (load_dir(dir, img, start_block, block_count) < 0) {
+            return NULL;
+        }
+    }
+    return dir;
+}
+
+struct dir_entry_t *dir_lookup(struct dir_cache *cache, const struct disk_image *img,
+                               uint32_t start_block, uint32_t block_count, const char *name,
+                               enum entry_kind kind) {
+    if (!cache) {
+        return dir_find(img, start_block, block_count, name, kind);
+    }
+
+    struct cached_dir *dir = get_dir(cache, img, start_block, block_count);
+    if (!dir) {
+        return dir_find(img, start_block, block_count, name, kind);
+    }
+
+    uint32_t i = name_hash(name, strlen(name)) & dir->mask;
+    while (dir->slots[i]) {
+        if (entry_in_use(dir->slots[i]) && entry_is_kind(dir->slots[i], kind) &&
+            entry_name_eq(dir->slots[i], name)) {
+            return (struct dir_entry_t *)dir->slots[i];
+        }
+        i = (i + 1) & dir->mask;
+    }
+    return NULL;
+}
+
+struct dir_entry_t *dir_lookup_free_slot(struct dir_cache *cache, const struct disk_image *img,
+                                         uint32_t start_block, uint32_t block_count) {
+    if (!cache) {
+        return dir_free_slot(img, start_block, block_count);
+    }
+
+    struct cached_dir *dir = get_dir(cache, img, start_block, block_count);
+    if (!dir) {
+        return dir_free_slot(img, start_block, block_count);
+    }
+
+    // Resume from where the last free slot was found
+    struct dir_iter it = dir->free_hint;
+    for (;;) {
+        struct dir_iter before = it;
+        struct dir_entry_t *entry = dir_iter_next(&it);
+        if (!entry) {
+            break;
+        }
+        if (!entry_in_use(entry)) {
+            dir->free_hint = before;
+            return entry;
+        }
+    }
+    dir->free_hint = it;
+    return NULL;
+}
+
+void dircache_insert(struct dir_cache *cache, uint32_t start_block, const struct dir_entry_t *entry) {
+    if (!cache) {
+        return;
+    }
+
+    struct cached_dir *dir = find_dir(cache, start_block);
+    if (dir && dir->mask != 0 && insert_name(dir, entry) < 0) {
+        dircache_invalidate(cache, start_block);
+    }
+}
+
+void dircache_invalidate(struct dir_cache *cache, uint32_t start_block) {
+    if (!cache) {
+        return;
+    }
+
+    struct cached_dir *dir = find_dir(cache, start_block);
+    if (dir) {
+        free(dir->slots);
+        dir->slots = NULL;
+        dir->mask = 0;
+        dir->count = 0;
+    }
+}
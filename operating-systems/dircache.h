@@ -0,0 +1,48 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "diskimg.h"
+
+// Name table for one directory, built the first time the directory is searched
+struct cached_dir {
+    uint32_t start_block;       // key; FAT_EOF marks an empty slot
+    uint32_t block_count;
+    const struct dir_entry_t **slots;   // open-addressed by name hash, NULL when empty
+    uint32_t mask;              // table size - 1, or 0 while the directory is not loaded
+    uint32_t count;
+    struct dir_iter free_hint;  // no free entry before this position
+};
+
+// Directory entries keyed by (directory start block, name). Entries point into
+// the image mapping, so a lookup never copies or re-reads a directory.
+struct dir_cache {
+    struct cached_dir *dirs;    // open-addressed by start block
+    size_t mask;
+    size_t count;
+};
+
+int dircache_init(struct dir_cache *cache);
+void dircache_free(struct dir_cache *cache);
+
+// Look up the file or directory called name in the directory at start_block,
+// loading the directory on first touch; kind is ENTRY_FILE or ENTRY_DIR. With
+// a NULL cache this is a plain dir_find().
+struct dir_entry_t *dir_lookup(struct dir_cache *cache, const struct disk_image *img,
+                               uint32_t start_block, uint32_t block_count, const char *name,
+                               enum entry_kind kind);
+
+// Find an unused slot in the directory without rescanning the entries
+// already known to be in use. With a NULL cache this is dir_free_slot().
+struct dir_entry_t *dir_lookup_free_slot(struct dir_cache *cache, const struct disk_image *img,
+                                         uint32_t start_block, uint32_t block_count);
+
+// Record an entry just written into a directory, keeping its table current
+void dircache_insert(struct dir_cache *cache, uint32_t start_block, const struct dir_entry_t *entry);
+
+// Forget what is cached for a directory; it is reloaded on the next lookup
+void dircache_invalidate(struct dir_cache *cache, uint32_t start_block);
+
+#endif
@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "diskimg.h"
+
+// Times diskinfo, disklist, diskget and diskput over a set of images, one
+// process per operation, and reports each case as a CSV row. The tools run
+// with the page cache warm after their first run; latencies are wall-clock
+// times from fork to exit.
+
+// Files put per run of the put-batch case
+#define BATCH_FILES 64
+
+// A file found in an image
+struct bench_file {
+    char *path;
+    uint32_t size;
+};
+
+struct file_list {
+    struct bench_file *files;
+    size_t count;
+    size_t capacity;
+    uint64_t dirs;
+    uint64_t bytes;
+};
+
+// Timings of one case; failed runs count towards the latencies only
+struct bench_case {
+    const char *name;
+    unsigned runs;
+    unsigned failures;
+    uint64_t bytes;
+    uint64_t ops;
+    double *latency;            // seconds, one per run
+};
+
+struct bench_options {
+    const char *tool_dir;
+    const char *scratch_dir;
+    unsigned runs;
+    FILE *out;
+};
+
+// Function prototypes
+int bench_image(const struct bench_options *opts, const char *image);
+int collect_files(const struct disk_image *img, uint32_t start_block, uint32_t block_count,
+                  const char *path, uint64_t *visited, struct file_list *list);
+void free_files(struct file_list *list);
+int run_tool(const struct bench_options *opts, const char *const argv[], int count_output,
+             double *seconds, uint64_t *output_bytes);
+void report(const struct bench_options *opts, const char *image, struct bench_case *c);
+
+int main(int argc, char *argv[]) {
+    struct bench_options opts = { ".", NULL, 10, stdout };
+    const char *out_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:t:w:o:")) != -1) {
+        switch (opt) {
+        case 'r':
+            opts.runs = atoi(optarg);
+            break;
+        case 't':
+            opts.tool_dir = optarg;
+            break;
+        case 'w':
+            opts.scratch_dir = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            opts.runs = 0;
+            break;
+        }
+    }
+
+    if (argc - optind < 1 || opts.runs < 1) {
+        fprintf(stderr, "Usage: %s [-r runs] [-t tool directory] [-w scratch directory] [-o csv] <disk image>...\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char scratch_template[] = "/tmp/diskbench.XXXXXX";
+    int own_scratch = !opts.scratch_dir;
+    if (own_scratch && !(opts.scratch_dir = mkdtemp(scratch_template))) {
+        perror("Error creating scratch directory");
+        return EXIT_FAILURE;
+    }
+
+    if (out_path && !(opts.out = fopen(out_path, "w"))) {
+        perror(out_path);
+        return EXIT_FAILURE;
+    }
+    fprintf(opts.out, "image,case,runs,failures,bytes,ops,seconds,mb_per_s,ops_per_s,p50_ms,p99_ms\n");
+
+    int status = EXIT_SUCCESS;
+    for (int i = optind; i < argc; i++) {
+        if (bench_image(&opts, argv[i]) < 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (opts.out != stdout) {
+        fclose(opts.out);
+    }
+    if (own_scratch) {
+        rmdir(opts.scratch_dir);
+    }
+    return status;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Function to delete a scratch file or directory tree
+static void remove_tree(const char *path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Function to copy src to a new file at dst
+static int copy_path(const char *src, const char *dst) {
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        perror(src);
+        return -1;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror(dst);
+        close(in);
+        return -1;
+    }
+
+    int status = 0;
+    ssize_t copied;
+    while ((copied = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) {
+    }
+    if (copied < 0) {
+        // Not supported between these file systems: copy by hand
+        char buf[1 << 16];
+        ssize_t len;
+        lseek(in, 0, SEEK_SET);
+        lseek(out, 0, SEEK_SET);
+        while ((len = read_full(in, buf, sizeof(buf))) > 0 && write_full(out, buf, len) == 0) {
+        }
+        if (len != 0) {
+            perror(dst);
+            status = -1;
+        }
+    }
+    close(in);
+    close(out);
+    return status;
+}
+
+// Function to write a host file of size random bytes
+static int make_input(const char *path, uint32_t size, uint64_t seed) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    uint64_t buf[4096];
+    int status = 0;
+    while (size > 0 && status == 0) {
+        for (size_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            buf[i] = seed;
+        }
+        size_t len = size < sizeof(buf) ? size : sizeof(buf);
+        status = write_full(fd, buf, len);
+        size -= len;
+    }
+    close(fd);
+    return status;
+}
+
+static struct bench_case *new_case(struct bench_case *c, const char *name, unsigned runs) {
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->latency = calloc(runs, sizeof(double));
+    if (!c->latency) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    return c;
+}
+
+// Function to time one run of a case and add it to the totals
+static void time_run(const struct bench_options *opts, struct bench_case *c, const char *const argv[],
+                     int count_output, uint64_t bytes, uint64_t ops) {
+    double seconds;
+    uint64_t output_bytes = 0;
+    if (run_tool(opts, argv, count_output, &seconds, &output_bytes) < 0) {
+        c->failures++;
+    } else {
+        c->bytes += count_output ? output_bytes : bytes;
+        c->ops += ops;
+    }
+    c->latency[c->runs++] = seconds;
+}
+
+// Function to run every case against one image
+int bench_image(const struct bench_options *opts, const char *image) {
+    struct disk_image img;
+    if (image_open(&img, image, 0) < 0) {
+        return -1;
+    }
+
+    struct file_list list = {0};
+    uint64_t *visited = calloc(img.size / img.sb.block_size / 64 + 1, sizeof(uint64_t));
+    if (!visited || collect_files(&img, img.sb.root_start, img.sb.root_blocks, "", visited, &list) < 0) {
+        if (!visited) {
+            perror("Memory allocation failed");
+        }
+        free(visited);
+        free_files(&list);
+        image_close(&img);
+        return -1;
+    }
+    free(visited);
+    uint64_t fat_bytes = (uint64_t)img.fat_entries * sizeof(uint32_t);
+    image_close(&img);
+
+    if (list.count == 0) {
+        fprintf(stderr, "Error: %s has no files to benchmark with.\n", image);
+        free_files(&list);
+        return -1;
+    }
+
+    unsigned runs = opts->runs;
+    struct bench_case c;
+    char path[4096], path2[4096], dest[64];
+    int status = 0;
+
+    // diskinfo, scanning the FAT and with the fragmentation report
+    if (new_case(&c, "info", runs)) {
+        for (unsigned r = 0; r < runs; r++) {
+            const char *argv[] = { "diskinfo", "-s", image, NULL };
+            time_run(opts, &c, argv, 0, fat_bytes, 1);
+        }
+        report(opts, image, &c);
+    }
+    if (new_case(&c, "info-frag", runs)) {
+        for (unsigned r = 0; r < runs; r++) {
+            const char *argv[] = { "diskinfo", "-f", image, NULL };
+            time_run(opts, &c, argv, 0, fat_bytes, 1);
+        }
+        report(opts, image, &c);
+    }
+
+    // disklist of the whole tree
+    if (new_case(&c, "list", runs)) {
+        for (unsigned r = 0; r < runs; r++) {
+            const char *argv[] = { "disklist", "-R", image, "/", NULL };
+            time_run(opts, &c, argv, 1, 0, list.count + list.dirs);
+        }
+        report(opts, image, &c);
+    }
+
+    // diskget of one file per run, spread over the image
+    snprintf(path, sizeof(path), "%s/get.out", opts->scratch_dir);
+    if (new_case(&c, "get", runs)) {
+        for (unsigned r = 0; r < runs; r++) {
+            const struct bench_file *file = &list.files[(size_t)r * 7919 % list.count];
+            const char *argv[] = { "diskget", image, file->path, path, NULL };
+            time_run(opts, &c, argv, 0, file->size, 1);
+        }
+        unlink(path);
+        report(opts, image, &c);
+    }
+
+    // diskget -r of the whole tree into a fresh directory each run
+    snprintf(path, sizeof(path), "%s/tree", opts->scratch_dir);
+    if (new_case(&c, "get-tree", runs)) {
+        for (unsigned r = 0; r < runs; r++) {
+            if (mkdir(path, 0777) < 0) {
+                perror(path);
+                c.failures++;
+                break;
+            }
+            const char *argv[] = { "diskget", "-r", image, "/", path, NULL };
+            time_run(opts, &c, argv, 0, list.bytes, list.count);
+            remove_tree(path);
+        }
+        report(opts, image, &c);
+    }
+
+    // diskput into a copy of the image, one file per run and then batches
+    // of BATCH_FILES; input sizes are those of files in the image
+    snprintf(path, sizeof(path), "%s/put.img", opts->scratch_dir);
+    unsigned inputs = list.count < BATCH_FILES ? list.count : BATCH_FILES;
+    uint64_t input_bytes = 0;
+    if (copy_path(image, path) < 0) {
+        status = -1;
+    }
+    for (unsigned i = 0; i < inputs && status == 0; i++) {
+        snprintf(path2, sizeof(path2), "%s/in%u", opts->scratch_dir, i);
+        uint32_t size = list.files[(size_t)i * 7919 % list.count].size;
+        status = make_input(path2, size, i + 1);
+        input_bytes += size;
+    }
+
+    if (status == 0 && new_case(&c, "put", runs)) {
+        for (unsigned r = 0; r < runs; r++) {
+            unsigned i = r % inputs;
+            snprintf(path2, sizeof(path2), "%s/in%u", opts->scratch_dir, i);
+            snprintf(dest, sizeof(dest), "/bench/p%u", r);
+            const char *argv[] = { "diskput", path, path2, dest, NULL };
+            time_run(opts, &c, argv, 0, list.files[(size_t)i * 7919 % list.count].size, 1);
+        }
+        report(opts, image, &c);
+    }
+
+    snprintf(path2, sizeof(path2), "%s/manifest", opts->scratch_dir);
+    if (status == 0 && new_case(&c, "put-batch", runs)) {
+        for (unsigned r = 0; r < runs; r++) {
+            FILE *manifest = fopen(path2, "w");
+            if (!manifest) {
+                perror(path2);
+                c.failures++;
+                break;
+            }
+            for (unsigned i = 0; i < inputs; i++) {
+                fprintf(manifest, "%s/in%u\t/batch/f%u\n", opts->scratch_dir, i, i);
+            }
+            fclose(manifest);
+
+            // Each batch starts from the original image, so it cannot run out of space
+            if (copy_path(image, path) < 0) {
+                c.failures++;
+                break;
+            }
+            const char *argv[] = { "diskput", "-b", path2, path, NULL };
+            time_run(opts, &c, argv, 0, input_bytes, inputs);
+        }
+        report(opts, image, &c);
+    }
+
+    unlink(path);
+    unlink(path2);
+    for (unsigned i = 0; i < inputs; i++) {
+        snprintf(path2, sizeof(path2), "%s/in%u", opts->scratch_dir, i);
+        unlink(path2);
+    }
+    free_files(&list);
+    return status;
+}
+
+// Function to list every file below a directory, with its size
+int collect_files(const struct disk_image *img, uint32_t start_block, uint32_t block_count,
+                  const char *path, uint64_t *visited, struct file_list *list) {
+    // A directory reachable twice means the image has a cycle; walk it once
+    if (start_block < img->size / img->sb.block_size) {
+        if (visited[start_block / 64] >> (start_block % 64) & 1) {
+            return 0;
+        }
+        visited[start_block / 64] |= (uint64_t)1 << (start_block % 64);
+    }
+    if (!image_contains(img, start_block, 1)) {
+        return 0;
+    }
+
+    struct dir_iter it;
+    const struct dir_entry_t *entry;
+
+    dir_iter_init(&it, img, start_block, block_count);
+    while ((entry = dir_iter_next(&it))) {
+        if (!entry_in_use(entry) || entry_name_len(entry) == 0 ||
+            entry_name_eq(entry, ".") || entry_name_eq(entry, "..")) {
+            continue;
+        }
+
+        size_t path_size = strlen(path) + 32;
+        char *entry_path = malloc(path_size);
+        if (!entry_path) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        snprintf(entry_path, path_size, "%s/%.*s", path, entry_name_len(entry), entry->filename);
+
+        if (entry_is_dir(entry)) {
+            list->dirs++;
+            int status = collect_files(img, entry_start_block(entry), entry_block_count(entry),
+                                       entry_path, visited, list);
+            free(entry_path);
+            if (status < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (list->count == list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 256;
+            struct bench_file *files = realloc(list->files, capacity * sizeof(struct bench_file));
+            if (!files) {
+                perror("Memory allocation failed");
+                free(entry_path);
+                return -1;
+            }
+            list->files = files;
+            list->capacity = capacity;
+        }
+        list->files[list->count].path = entry_path;
+        list->files[list->count].size = entry_file_size(entry);
+        list->bytes += entry_file_size(entry);
+        list->count++;
+    }
+    return 0;
+}
+
+void free_files(struct file_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->files[i].path);
+    }
+    free(list->files);
+    memset(list, 0, sizeof(*list));
+}
+
+// Function to run a tool to completion, timing it. Its stdout goes to
+// /dev/null, or with count_output through a pipe so the bytes can be counted.
+int run_tool(const struct bench_options *opts, const char *const argv[], int count_output,
+             double *seconds, uint64_t *output_bytes) {
+    char tool[4096];
+    snprintf(tool, sizeof(tool), "%s/%s", opts->tool_dir, argv[0]);
+
+    int out[2] = { -1, -1 };
+    if (count_output ? pipe(out) < 0 : (out[1] = open("/dev/null", O_WRONLY)) < 0) {
+        perror("Error preparing tool output");
+        *seconds = 0;
+        return -1;
+    }
+    fflush(opts->out);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        if (out[0] >= 0) {
+            close(out[0]);
+        }
+        close(out[1]);
+        execv(tool, (char *const *)argv);
+        perror(tool);
+        _exit(127);
+    }
+    close(out[1]);
+
+    if (out[0] >= 0) {
+        char buf[1 << 16];
+        ssize_t len;
+        while ((len = read(out[0], buf, sizeof(buf))) > 0 || (len < 0 && errno == EINTR)) {
+            *output_bytes += len > 0 ? len : 0;
+        }
+        close(out[0]);
+    }
+
+    int wstatus = 0;
+    int waited = pid > 0 ? waitpid(pid, &wstatus, 0) : -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (pid < 0) {
+        perror("Error starting tool");
+        return -1;
+    }
+    if (waited < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        fprintf(stderr, "Warning: %s %s failed.\n", argv[0], argv[1]);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted latencies
+static double percentile(const double *sorted, unsigned n, unsigned p) {
+    unsigned rank = (n * p + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Function to print one case as a CSV row
+void report(const struct bench_options *opts, const char *image, struct bench_case *c) {
+    double total = 0;
+    for (unsigned i = 0; i < c->runs; i++) {
+        total += c->latency[i];
+    }
+
+    if (c->runs > 0) {
+        qsort(c->latency, c->runs, sizeof(double), compare_double);
+        fprintf(opts->out, "%s,%s,%u,%u,%llu,%llu,%.6f,%.2f,%.2f,%.3f,%.3f\n", image, c->name, c->runs,
+                c->failures, (unsigned long long)c->bytes, (unsigned long long)c->ops, total,
+                total > 0 ? c->bytes / total / 1e6 : 0, total > 0 ? c->ops / total : 0,
+                percentile(c->latency, c->runs, 50) * 1e3, percentile(c->latency, c->runs, 99) * 1e3);
+        fflush(opts->out);
+    }
+    free(c->latency);
+    c->latency = NULL;
+}
@@ -0,0 +1,844 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "diskimg.h"
+#include "freemap.h"
+#include "dircache.h"
+#include "imginfo.h"
+#include "imglist.h"
+#include "imgget.h"
+#include "imgput.h"
+#include "imgdefrag.h"
+#include "imgfsck.h"
+#include "imgverify.h"
+#include "fatscan.h"
+#include "journal.h"
+#include "stats.h"
+#include "diskproto.h"
+
+// Size of the stdout buffer, so a large listing goes out in few writes
+#define OUTPUT_BUFFER (1 << 20)
+
+// Most puts whose replies wait on one group commit
+#define GROUP_MAX 64
+
+// Most clients connected at once; any more wait in the listen backlog
+#define MAX_CONNECTIONS 256
+
+// Milliseconds a client has to send its whole request
+#define REQUEST_TIMEOUT 5000
+
+// Bytes moved through a spool per read or write
+#define SPOOL_CHUNK (64 * 1024)
+
+// An image held open with its FAT, free map and directory cache kept warm
+// between requests
+struct served_image {
+    char *path;                 // absolute path, as clients send it
+    struct disk_image img;
+    struct free_map free_map;
+    struct dir_cache dir_cache;
+    struct put_context ctx;
+};
+
+// A descriptor of a client's that could block (a pipe, a terminal, a socket)
+// and a file of ours standing in for it: the client's stdin, read ahead of
+// the request that needs it, or what a request wrote to its stdout or stderr,
+// passed on afterwards. The client's descriptor is only touched when poll
+// says it is ready, and without blocking.
+struct spool {
+    int fd;                     // memfd holding the data, or -1 for none
+    int watch;                  // the client's descriptor, as polled
+    int peer;                   // the same, opened non-blocking; -1 when nobody reads it
+    int peer_is_socket;         // peer is the client's own socket: use MSG_DONTWAIT
+    off_t size;                 // bytes in fd
+    off_t done;                 // of them passed on to the client
+};
+
+enum conn_state {
+    CONN_REQUEST,               // the request is arriving
+    CONN_INPUT,                 // reading the client's stdin ahead of the request
+    CONN_READY,                 // waiting its turn to run
+    CONN_OUTPUT,                // answered once its output is passed on (and its put committed)
+    CONN_CLOSED                 // dropped without an answer
+};
+
+// A connected client and its request
+struct connection {
+    int sock;
+    enum conn_state state;
+    int foreign;                // runs as another user, so is refused
+    uid_t uid;
+    int64_t deadline;           // for the request to arrive, in monotonic milliseconds
+    uint64_t ticket;            // order in which requests became ready to run
+    struct diskd_receiver receiver;
+    struct diskd_request request;
+    char *args[DISKD_MAX_ARGS];
+    int fds[DISKD_FDS];         // the client's stdin, stdout, stderr and working directory
+    int std_fds[3];             // what the request runs with as its stdin, stdout and stderr
+    struct served_image *served;
+    struct spool input;
+    struct spool output[2];     // stdout, stderr
+    int status;
+    int uncommitted;            // a put whose reply waits for the group commit
+};
+
+static volatile sig_atomic_t stopping;
+
+// Read from by requests that have no business reading the client's stdin
+static int null_fd = -1;
+
+static uint64_t next_ticket;
+static uint8_t spool_buffer[SPOOL_CHUNK];
+
+// Function prototypes
+int serve_image_open(struct served_image *served, const char *path);
+void serve_image_close(struct served_image *served);
+int open_socket(const char *socket_path);
+void accept_clients(int sock, struct connection **conns, int *conn_count, struct served_image *images,
+                    int count);
+void progress_connection(struct connection *conn, struct served_image *images, int count);
+void prepare_request(struct connection *conn, struct served_image *images, int count);
+void run_connection(struct connection *conn);
+int run_request(struct served_image *served, const struct diskd_request *request, char *args[]);
+void commit_group(struct served_image *images, int count, struct connection **conns, int conn_count);
+void close_connection(struct connection *conn);
+
+static void handle_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char *argv[]) {
+    const char *socket_path = getenv(DISKD_SOCKET_ENV);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's') {
+            socket_path = optarg;
+        } else {
+            argc = -1;
+        }
+    }
+
+    if (argc - optind < 1 || !socket_path || !*socket_path) {
+        fprintf(stderr, "Usage: %s [-s socket] <disk image>...\n", argv[0]);
+        fprintf(stderr, "       (the socket defaults to $%s)\n", DISKD_SOCKET_ENV);
+        return EXIT_FAILURE;
+    }
+
+    // Open every image once, up front
+    int count = argc - optind;
+    struct served_image *images = calloc(count, sizeof(struct served_image));
+    struct connection **conns = calloc(MAX_CONNECTIONS, sizeof(struct connection *));
+    struct pollfd *polls = calloc(2 * MAX_CONNECTIONS + 1, sizeof(struct pollfd));
+    struct connection **owners = calloc(2 * MAX_CONNECTIONS + 1, sizeof(struct connection *));
+    if (!images || !conns || !polls || !owners) {
+        perror("Memory allocation failed");
+        free(images);
+        free(conns);
+        free(polls);
+        free(owners);
+        return EXIT_FAILURE;
+    }
+    int opened = 0;
+    while (opened < count && serve_image_open(&images[opened], argv[optind + opened]) == 0) {
+        opened++;
+    }
+
+    null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null_fd < 0) {
+        perror("/dev/null");
+    }
+    int sock = opened == count && null_fd >= 0 ? open_socket(socket_path) : -1;
+    if (sock < 0) {
+        if (null_fd >= 0) {
+            close(null_fd);
+        }
+        for (int i = 0; i < opened; i++) {
+            serve_image_close(&images[i]);
+        }
+        free(images);
+        free(conns);
+        free(polls);
+        free(owners);
+        return EXIT_FAILURE;
+    }
+
+    // Stop cleanly on SIGINT/SIGTERM; a client going away must not kill us
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    char *buffer = malloc(OUTPUT_BUFFER);
+    if (buffer) {
+        setvbuf(stdout, buffer, _IOFBF, OUTPUT_BUFFER);
+    }
+
+    // One request runs at a time, so the caches never need locking, but no
+    // client can hold up the others: requests arrive, stdin is read ahead and
+    // output is passed on as poll says each client is ready, and a request
+    // only runs once nothing it does can wait on its client. Puts are
+    // committed in groups: while other requests are ready to run, a finished
+    // put's reply is held back, and the whole group is committed with one
+    // round of syncs as soon as none are (or the group is full).
+    int conn_count = 0;
+
+    while (!stopping) {
+        int64_t now = now_ms();
+
+        // Answer the requests that are done, and drop the ones that broke
+        // off or took too long to arrive
+        for (int i = 0; i < conn_count;) {
+            struct connection *conn = conns[i];
+            int answered = conn->state == CONN_OUTPUT && !conn->uncommitted &&
+                           conn->output[0].done >= conn->output[0].size &&
+                           conn->output[1].done >= conn->output[1].size;
+            if (answered) {
+                diskd_reply(conn->sock, conn->status);
+            }
+            if (answered || conn->state == CONN_CLOSED ||
+                (conn->state == CONN_REQUEST && now >= conn->deadline)) {
+                close_connection(conn);
+                conns[i] = conns[--conn_count];
+            } else {
+                i++;
+            }
+        }
+
+        int timeout = -1;
+        int npolls = 0;
+        int ready = 0, pending = 0;
+
+        if (conn_count < MAX_CONNECTIONS) {
+            polls[npolls] = (struct pollfd){ sock, POLLIN, 0 };
+            owners[npolls++] = NULL;
+        }
+        for (int i = 0; i < conn_count; i++) {
+            struct connection *conn = conns[i];
+            pending += conn->uncommitted;
+
+            if (conn->state == CONN_REQUEST) {
+                int64_t left = conn->deadline > now ? conn->deadline - now : 0;
+                if (timeout < 0 || left < timeout) {
+                    timeout = left;
+                }
+                polls[npolls] = (struct pollfd){ conn->sock, POLLIN, 0 };
+                owners[npolls++] = conn;
+            } else if (conn->state == CONN_INPUT) {
+                polls[npolls] = (struct pollfd){ conn->input.watch, POLLIN, 0 };
+                owners[npolls++] = conn;
+            } else if (conn->state == CONN_READY) {
+                ready++;
+            } else if (conn->state == CONN_OUTPUT) {
+                for (int k = 0; k < 2; k++) {
+                    if (conn->output[k].done < conn->output[k].size) {
+                        polls[npolls] = (struct pollfd){ conn->output[k].watch, POLLOUT, 0 };
+                        owners[npolls++] = conn;
+                    }
+                }
+            }
+        }
+        if (ready > 0 || pending > 0) {
+            timeout = 0;
+        }
+
+        if (poll(polls, npolls, timeout) < 0) {
+            if (errno != EINTR) {
+                perror("Error waiting for clients");
+            }
+            continue;
+        }
+        for (int i = 0; i < npolls; i++) {
+            if (polls[i].revents && owners[i]) {
+                progress_connection(owners[i], images, count);
+            } else if (polls[i].revents) {
+                accept_clients(sock, conns, &conn_count, images, count);
+            }
+        }
+
+        // Run the request that has waited longest, unless the group is due
+        struct connection *next = NULL;
+        for (int i = 0; i < conn_count; i++) {
+            if (conns[i]->state == CONN_READY && (!next || conns[i]->ticket < next->ticket)) {
+                next = conns[i];
+            }
+        }
+        if (pending > 0 && (!next || pending >= GROUP_MAX)) {
+            commit_group(images, count, conns, conn_count);
+        } else if (next) {
+            run_connection(next);
+        }
+    }
+
+    // Answer what has already run, with whatever of its output the client
+    // takes straight away; the rest is dropped
+    commit_group(images, count, conns, conn_count);
+    for (int i = 0; i < conn_count; i++) {
+        if (conns[i]->state == CONN_OUTPUT) {
+            progress_connection(conns[i], images, count);
+            diskd_reply(conns[i]->sock, conns[i]->status);
+        }
+        close_connection(conns[i]);
+    }
+
+    close(sock);
+    unlink(socket_path);
+    close(null_fd);
+    for (int i = 0; i < count; i++) {
+        serve_image_close(&images[i]);
+    }
+    free(images);
+    free(conns);
+    free(polls);
+    free(owners);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+// Function to open an image for serving, with its free map and directory cache
+int serve_image_open(struct served_image *served, const char *path) {
+    served->path = realpath(path, NULL);
+    if (!served->path) {
+        perror(path);
+        return -1;
+    }
+    if (image_open(&served->img, path, 1) < 0) {
+        free(served->path);
+        return -1;
+    }
+    if (image_mark_served(&served->img) < 0) {
+        image_close(&served->img);
+        free(served->path);
+        return -1;
+    }
+    if (freemap_build(&served->free_map, &served->img) < 0) {
+        image_close(&served->img);
+        free(served->path);
+        return -1;
+    }
+    if (dircache_init(&served->dir_cache) < 0) {
+        freemap_free(&served->free_map);
+        image_close(&served->img);
+        free(served->path);
+        return -1;
+    }
+
+    served->ctx.img = &served->img;
+    served->ctx.free_map = &served->free_map;
+    served->ctx.dir_cache = &served->dir_cache;
+    return 0;
+}
+
+void serve_image_close(struct served_image *served) {
+    dircache_free(&served->dir_cache);
+    freemap_free(&served->free_map);
+    image_close(&served->img);
+    free(served->path);
+}
+
+// Function to listen on the socket, replacing a stale one left behind
+int open_socket(const char *socket_path) {
+    struct sockaddr_un addr = {0};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long.\n", socket_path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+        perror(socket_path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+// Function to put a spool between a request and one of the client's
+// descriptors. Anything but a socket is reopened through /proc with
+// O_NONBLOCK, so the file status flags the client shares stay as they are.
+static int spool_open(struct spool *spool, int fd, int flags) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("Error examining the client's descriptor");
+        return -1;
+    }
+
+    // poll must watch the client's own descriptor: one reopened through
+    // /proc is a FIFO's reader, which is never told that the writer left
+    spool->watch = fd;
+    if (S_ISSOCK(st.st_mode)) {
+        spool->peer = fd;
+        spool->peer_is_socket = 1;
+    } else {
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        spool->peer = open(path, flags | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+
+        // A pipe nobody reads any more can't be opened for writing; its
+        // output has nowhere to go
+        if (spool->peer < 0 && !(flags == O_WRONLY && errno == ENXIO)) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    spool->fd = memfd_create("diskd-spool", MFD_CLOEXEC);
+    if (spool->fd < 0) {
+        perror("Error creating a spool");
+        return -1;
+    }
+    return 0;
+}
+
+static void spool_close(struct spool *spool) {
+    if (spool->fd >= 0) {
+        close(spool->fd);
+    }
+    if (spool->peer >= 0 && !spool->peer_is_socket) {
+        close(spool->peer);
+    }
+    spool->fd = spool->peer = -1;
+}
+
+// Function to read what the client has for the spool so far. Returns 1 at the
+// end of the input, 0 while more is to come, or -1 on an error.
+static int spool_fill(struct spool *spool) {
+    // A few chunks at a time, so a fast writer does not hold up the others
+    for (int i = 0; i < 16; i++) {
+        ssize_t got = spool->peer_is_socket ? recv(spool->peer, spool_buffer, SPOOL_CHUNK, MSG_DONTWAIT)
+                                            : read(spool->peer, spool_buffer, SPOOL_CHUNK);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (got == 0) {
+            return 1;
+        }
+        if (write_full(spool->fd, spool_buffer, got) < 0) {
+            return -1;
+        }
+        spool->size += got;
+    }
+    return 0;
+}
+
+// Function to pass on as much of the spool as the client takes without
+// blocking. Output the client can no longer take is dropped.
+static void spool_drain(struct spool *spool) {
+    if (spool->peer < 0) {
+        spool->done = spool->size;
+    }
+
+    for (int i = 0; i < 16 && spool->done < spool->size; i++) {
+        ssize_t len = pread(spool->fd, spool_buffer, SPOOL_CHUNK, spool->done);
+        if (len <= 0) {
+            spool->done = spool->size;
+            break;
+        }
+
+        ssize_t sent = spool->peer_is_socket ? send(spool->peer, spool_buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+                                             : write(spool->peer, spool_buffer, len);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (sent < 0) {
+            spool->done = spool->size;
+            break;
+        }
+        spool->done += sent;
+    }
+}
+
+static int is_regular(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Function to take every connection waiting to be accepted, up to
+// MAX_CONNECTIONS. Host paths are opened with our credentials, so only
+// clients running as our own user are served.
+void accept_clients(int sock, struct connection **conns, int *conn_count, struct served_image *images,
+                    int count) {
+    while (*conn_count < MAX_CONNECTIONS) {
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error accepting connection");
+            }
+            return;
+        }
+
+        struct connection *conn = calloc(1, sizeof(struct connection));
+        if (!conn) {
+            perror("Memory allocation failed");
+            close(fd);
+            return;
+        }
+        conn->sock = fd;
+        conn->state = CONN_REQUEST;
+        conn->deadline = now_ms() + REQUEST_TIMEOUT;
+        for (int i = 0; i < DISKD_FDS; i++) {
+            conn->fds[i] = -1;
+        }
+        conn->input.fd = conn->input.peer = -1;
+        conn->output[0].fd = conn->output[0].peer = -1;
+        conn->output[1].fd = conn->output[1].peer = -1;
+
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+            conn->foreign = 1;
+            conn->uid = (uid_t)-1;
+        } else {
+            conn->foreign = cred.uid != geteuid();
+            conn->uid = cred.uid;
+        }
+        conns[(*conn_count)++] = conn;
+
+        // The request usually arrives with the connection
+        progress_connection(conn, images, count);
+    }
+}
+
+// Function to move a connection along as far as it goes without blocking
+void progress_connection(struct connection *conn, struct served_image *images, int count) {
+    int got;
+
+    switch (conn->state) {
+    case CONN_REQUEST:
+        got = diskd_receive(conn->sock, &conn->receiver, &conn->request, conn->args, conn->fds);
+        if (got < 0) {
+            conn->state = CONN_CLOSED;
+        } else if (got > 0) {
+            prepare_request(conn, images, count);
+        }
+        break;
+
+    case CONN_INPUT:
+        got = spool_fill(&conn->input);
+        if (got < 0) {
+            dprintf(conn->std_fds[2], "Error: Could not read the input.\n");
+            conn->status = -1;
+            conn->state = CONN_OUTPUT;
+        } else if (got > 0) {
+            lseek(conn->input.fd, 0, SEEK_SET);
+            conn->state = CONN_READY;
+            conn->ticket = next_ticket++;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    // Pass on the output, counting anything of ours written to a spool
+    // outside the request itself
+    if (conn->state == CONN_OUTPUT) {
+        for (int k = 0; k < 2; k++) {
+            struct stat st;
+            if (conn->output[k].fd >= 0 && fstat(conn->output[k].fd, &st) == 0) {
+                conn->output[k].size = st.st_size;
+            }
+            spool_drain(&conn->output[k]);
+        }
+    }
+}
+
+// Function to set up a request that has arrived: find its image, and put a
+// spool in front of each of the client's descriptors that could block. A
+// request that is not served is answered straight away.
+void prepare_request(struct connection *conn, struct served_image *images, int count) {
+    conn->state = CONN_OUTPUT;
+    if (conn->foreign) {
+        fprintf(stderr, "Warning: Refused a request from user %d.\n", (int)conn->uid);
+        conn->status = DISKD_REFUSED;
+        return;
+    }
+
+    conn->status = DISKD_UNAVAILABLE;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(images[i].path, conn->args[0]) == 0) {
+            conn->served = &images[i];
+            break;
+        }
+    }
+    if (!conn->served) {
+        return;
+    }
+
+    // Regular files never block, so the request writes to them directly
+    for (int k = 0; k < 2; k++) {
+        if (is_regular(conn->fds[k + 1])) {
+            conn->std_fds[k + 1] = conn->fds[k + 1];
+        } else if (spool_open(&conn->output[k], conn->fds[k + 1], O_WRONLY) == 0) {
+            conn->std_fds[k + 1] = conn->output[k].fd;
+        } else {
+            conn->status = -1;
+            return;
+        }
+    }
+
+    // Only a put of "-" reads stdin; anything else gets nothing from it
+    int reads_stdin = conn->request.op == DISKD_PUT && conn->request.argc >= 2 &&
+                      strcmp(conn->args[1], "-") == 0;
+    if (is_regular(conn->fds[0])) {
+        conn->std_fds[0] = conn->fds[0];
+    } else if (!reads_stdin) {
+        conn->std_fds[0] = null_fd;
+    } else if (spool_open(&conn->input, conn->fds[0], O_RDONLY) == 0) {
+        conn->std_fds[0] = conn->input.fd;
+        conn->state = CONN_INPUT;
+        return;
+    } else {
+        conn->status = -1;
+        return;
+    }
+
+    conn->state = CONN_READY;
+    conn->ticket = next_ticket++;
+}
+
+// Function to run a request that is ready. While it runs, the descriptors it
+// was set up with stand in for our stdin, stdout and stderr, and the client's
+// working directory for ours, so the operations behave exactly as they do
+// inside the tools. A put's reply then waits for the commit.
+void run_connection(struct connection *conn) {
+    const struct diskd_request *request = &conn->request;
+    int saved[3];
+
+    for (int i = 0; i < 3; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+        dup2(conn->std_fds[i], i);
+    }
+    int saved_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fchdir(conn->fds[3]) < 0) {
+        perror("Error entering the client's directory");
+        conn->status = -1;
+    } else {
+        static const char *const tools[] = { "diskd", "diskinfo", "disklist", "diskget", "diskput",
+                                             "diskdefrag", "diskfsck", "diskverify" };
+        if (request->options & DISKD_STATS) {
+            stats_enable(request->options & DISKD_STATS_JSON ? "json" : "text");
+        }
+        conn->status = run_request(conn->served, request, conn->args);
+        stats_report(request->op <= DISKD_VERIFY ? tools[request->op] : tools[0]);
+        conn->uncommitted = request->op == DISKD_PUT;
+    }
+
+    // Nothing of this client's may leak into the next request
+    fflush(stdout);
+    fflush(stderr);
+    clearerr(stdout);
+    __fpurge(stdin);
+    clearerr(stdin);
+
+    for (int i = 0; i < 3; i++) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+    }
+    if (saved_cwd >= 0) {
+        if (fchdir(saved_cwd) < 0) {
+            perror("Error restoring the working directory");
+        }
+        close(saved_cwd);
+    }
+
+    conn->state = CONN_OUTPUT;
+    progress_connection(conn, NULL, 0);
+}
+
+void close_connection(struct connection *conn) {
+    diskd_receiver_free(&conn->receiver);
+    diskd_free_args(conn->args, DISKD_MAX_ARGS);
+    spool_close(&conn->input);
+    spool_close(&conn->output[0]);
+    spool_close(&conn->output[1]);
+    for (int i = 0; i < DISKD_FDS; i++) {
+        if (conn->fds[i] >= 0) {
+            close(conn->fds[i]);
+        }
+    }
+    close(conn->sock);
+    free(conn);
+}
+
+// Function to carry out a request against a served image
+int run_request(struct served_image *served, const struct diskd_request *request, char *args[]) {
+    struct disk_image *img = &served->img;
+    int workers = request->value > 0 ? (int)request->value : 1;
+    unsigned queue_depth = request->depth;
+
+    switch (request->op) {
+    case DISKD_INFO:
+        if (request->argc == 1) {
+            print_image_info(img, workers, request->options & DISKD_INFO_FRAG,
+                             !(request->options & DISKD_INFO_RESCAN));
+            return 0;
+        }
+        break;
+
+    case DISKD_LIST:
+        if (request->argc == 2 && request->value <= FORMAT_BINARY) {
+            return list_directory(img, args[1], request->value, request->options & DISKD_LIST_RECURSIVE);
+        }
+        break;
+
+    case DISKD_GET:
+        if (request->argc == 3) {
+            set_get_queue_depth(queue_depth);
+            set_get_sparse(request->options & DISKD_GET_SPARSE);
+            int status;
+            if (request->options & DISKD_GET_RECURSIVE) {
+                status = extract_tree(img, args[1], args[2], workers);
+            } else {
+                status = get_file(img, args[1], args[2]);
+            }
+            set_get_queue_depth(0);
+            set_get_sparse(0);
+            return status;
+        }
+        break;
+
+    case DISKD_PUT:
+        if (request->argc == ((request->options & DISKD_PUT_BATCH) ? 2 : 3)) {
+            struct uring ring;
+            if (queue_depth > 0 && uring_init(&ring, queue_depth) == 0) {
+                served->ctx.ring = &ring;
+            }
+
+            served->ctx.sparse = (request->options & DISKD_PUT_SPARSE) != 0;
+            served->ctx.group_size = request->value;
+            served->ctx.uncommitted = 0;
+
+            int result;
+            if (request->options & DISKD_PUT_BATCH) {
+                result = add_files_from_manifest(&served->ctx, args[1]);
+            } else {
+                result = add_file_to_directory(&served->ctx, args[1], args[2]);
+            }
+
+            // The counts are kept current for the requests that follow; the
+            // metadata itself is committed with the rest of the group
+            struct fat_census census;
+            fat_census_of_map(img, &served->free_map, &census);
+            fat_summary_store(img, &census);
+
+            if (served->ctx.ring) {
+                uring_exit(served->ctx.ring);
+                served->ctx.ring = NULL;
+            }
+            return result;
+        }
+        break;
+
+    case DISKD_DEFRAG:
+        if (request->argc == 1) {
+            return defrag_image(img, &served->free_map, workers, request->options & DISKD_DEFRAG_DRY_RUN);
+        }
+        break;
+
+    case DISKD_FSCK:
+        if (request->argc == 1) {
+            int repair = request->options & DISKD_FSCK_REPAIR;
+            int problems = fsck_image(img, workers, repair);
+
+            // A repair can free blocks and entries anywhere, so the free map
+            // and directory cache start over
+            if (repair && problems > 0) {
+                freemap_free(&served->free_map);
+                dircache_free(&served->dir_cache);
+                if (freemap_build(&served->free_map, img) < 0 || dircache_init(&served->dir_cache) < 0) {
+                    return -1;
+                }
+            }
+            return problems < 0 || (problems > 0 && !repair) ? -1 : 0;
+        }
+        break;
+
+    case DISKD_VERIFY:
+        if (request->argc == 1 && (request->options & DISKD_VERIFY_BUILD)) {
+            return sums_build(img, workers);
+        }
+        if (request->argc == 3 && !(request->options & DISKD_VERIFY_BUILD)) {
+            return verify_path(img, args[1], args[2], workers) == 0 ? 0 : -1;
+        }
+        break;
+    }
+
+    fprintf(stderr, "Error: Malformed request.\n");
+    return -1;
+}
+
+
+// Function to commit every image the waiting puts changed; their replies
+// carry the outcome
+void commit_group(struct served_image *images, int count, struct connection **conns, int conn_count) {
+    for (int i = 0; i < count; i++) {
+        int puts = 0;
+        for (int j = 0; j < conn_count; j++) {
+            puts += conns[j]->uncommitted && conns[j]->served == &images[i];
+        }
+
+        if (journal_commit(&images[i].img) < 0) {
+            for (int j = 0; j < conn_count; j++) {
+                if (conns[j]->uncommitted && conns[j]->served == &images[i]) {
+                    conns[j]->status = -1;
+                }
+            }
+        } else {
+            // Only the puts stored the summary this commit holds
+            if (puts > 0) {
+                fat_summary_seal(&images[i].img);
+            }
+            freemap_settle(&images[i].free_map);
+        }
+    }
+
+    for (int j = 0; j < conn_count; j++) {
+        conns[j]->uncommitted = 0;
+    }
+}
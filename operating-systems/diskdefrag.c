@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "diskimg.h"
+#include "freemap.h"
+#include "imgdefrag.h"
+#include "diskproto.h"
+#include "stats.h"
+
+int main(int argc, char *argv[]) {
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int dry_run = 0;
+    int opt;
+    static const struct option long_options[] = { STATS_LONG_OPTION, { NULL, 0, NULL, 0 } };
+
+    while ((opt = getopt_long(argc, argv, "j:n", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 'n':
+            dry_run = 1;
+            break;
+        case STATS_OPTION:
+            if (stats_enable(optarg) < 0) {
+                workers = -1;
+            }
+            break;
+        default:
+            workers = -1;
+            break;
+        }
+    }
+
+    if (argc - optind != 1 || workers < 1) {
+        fprintf(stderr, "Usage: %s [-j workers] [-n] [--stats[=json]] <disk image>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // A running image server does the work if it has the image, so the image
+    // can be defragmented while it is being served
+    const char *args[] = { argv[optind] };
+    int served = diskd_call(DISKD_DEFRAG, dry_run ? DISKD_DEFRAG_DRY_RUN : 0, workers, 0, 1, args);
+    if (served != DISKD_UNAVAILABLE) {
+        return served < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    struct disk_image img;
+    if (image_open(&img, argv[optind], !dry_run) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    struct free_map free_map;
+    if (freemap_build(&free_map, &img) < 0) {
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    int status = defrag_image(&img, &free_map, workers, dry_run) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    freemap_free(&free_map);
+    image_close(&img);
+    stats_report("diskdefrag");
+    return status;
+}
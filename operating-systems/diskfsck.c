@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "diskimg.h"
+#include "imgfsck.h"
+#include "diskproto.h"
+#include "stats.h"
+
+int main(int argc, char *argv[]) {
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int repair = 0;
+    int opt;
+    static const struct option long_options[] = { STATS_LONG_OPTION, { NULL, 0, NULL, 0 } };
+
+    while ((opt = getopt_long(argc, argv, "j:r", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 'r':
+            repair = 1;
+            break;
+        case STATS_OPTION:
+            if (stats_enable(optarg) < 0) {
+                workers = -1;
+            }
+            break;
+        default:
+            workers = -1;
+            break;
+        }
+    }
+
+    if (argc - optind != 1 || workers < 1) {
+        fprintf(stderr, "Usage: %s [-j workers] [-r] [--stats[=json]] <disk image>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // A running image server does the work if it has the image
+    const char *args[] = { argv[optind] };
+    int served = diskd_call(DISKD_FSCK, repair ? DISKD_FSCK_REPAIR : 0, workers, 0, 1, args);
+    if (served != DISKD_UNAVAILABLE) {
+        return served < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    struct disk_image img;
+    if (image_open(&img, argv[optind], repair) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Problems left in place are a failure, so scripts can check an image
+    // before using it
+    int problems = fsck_image(&img, workers, repair);
+
+    image_close(&img);
+    stats_report("diskfsck");
+    return problems < 0 || (problems > 0 && !repair) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "diskimg.h"
+
+// Synthetic images for the benchmarks: a directory tree of the given depth
+// and width, with files spread round-robin over every directory, sizes drawn
+// from a fixed, uniform or log-uniform distribution, and a chosen share of
+// file blocks placed away from the block before them.
+
+// How file sizes are drawn
+enum size_dist { SIZE_FIXED, SIZE_UNIFORM, SIZE_LOG };
+
+struct gen_options {
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t files;
+    uint32_t depth;
+    uint32_t width;
+    uint32_t frag;              // percent of file blocks placed at random
+    uint32_t min_size;
+    uint32_t max_size;
+    enum size_dist dist;
+    uint64_t seed;
+};
+
+// A directory being built: its entries go into its blocks in order
+struct gen_dir {
+    uint32_t entries;
+    uint32_t used;
+    uint32_t *blocks;
+    uint32_t block_count;
+};
+
+// The image being built
+struct gen_image {
+    uint8_t *map;
+    size_t size;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t *fat;
+    uint64_t *used;             // per block: allocated
+    uint64_t rng;
+};
+
+// Function prototypes
+int parse_size(const char *arg, struct gen_options *opts);
+int generate(const char *path, const struct gen_options *opts);
+
+int main(int argc, char *argv[]) {
+    struct gen_options opts = { 512, 65536, 1000, 0, 4, 0, 1024, 65536, SIZE_UNIFORM, 1 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:n:f:s:d:w:F:S:")) != -1) {
+        switch (opt) {
+        case 'b':
+            opts.block_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            opts.block_count = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            opts.files = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            if (parse_size(optarg, &opts) < 0) {
+                argc = -1;
+            }
+            break;
+        case 'd':
+            opts.depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            opts.width = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            opts.frag = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            opts.seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            argc = -1;
+            break;
+        }
+    }
+
+    if (argc < 0 || argc - optind != 1 || opts.block_size < DIRECTORY_ENTRY_SIZE ||
+        opts.block_size > UINT16_MAX || opts.block_size % DIRECTORY_ENTRY_SIZE != 0 ||
+        opts.block_count < 16 || opts.width == 0 || opts.frag > 100) {
+        fprintf(stderr, "Usage: %s [-b block size] [-n block count] [-f files] [-s size] [-d depth]\n", argv[0]);
+        fprintf(stderr, "       %*s [-w width] [-F fragmentation %%] [-S seed] <disk image>\n",
+                (int)strlen(argv[0]), "");
+        fprintf(stderr, "       size is N bytes, MIN-MAX (uniform) or MIN-MAX:log (log-uniform)\n");
+        return EXIT_FAILURE;
+    }
+
+    return generate(argv[optind], &opts) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Function to parse a size distribution: N, MIN-MAX or MIN-MAX:log
+int parse_size(const char *arg, struct gen_options *opts) {
+    char *end;
+    opts->min_size = strtoul(arg, &end, 0);
+    opts->max_size = opts->min_size;
+    opts->dist = SIZE_FIXED;
+
+    if (*end == '-') {
+        opts->max_size = strtoul(end + 1, &end, 0);
+        opts->dist = SIZE_UNIFORM;
+        if (strcmp(end, ":log") == 0) {
+            opts->dist = SIZE_LOG;
+            end += 4;
+        }
+    }
+    if (*end != '\0' || opts->min_size == 0 || opts->max_size < opts->min_size) {
+        fprintf(stderr, "Error: Invalid file size %s.\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+// xorshift64*
+static uint64_t next_random(struct gen_image *gen) {
+    gen->rng ^= gen->rng >> 12;
+    gen->rng ^= gen->rng << 25;
+    gen->rng ^= gen->rng >> 27;
+    return gen->rng * 2685821657736338717ull;
+}
+
+static uint32_t draw_size(struct gen_image *gen, const struct gen_options *opts) {
+    double u = (next_random(gen) >> 11) * (1.0 / 9007199254740992.0);
+    switch (opts->dist) {
+    case SIZE_UNIFORM:
+        return opts->min_size + (uint32_t)(u * (opts->max_size - opts->min_size + 1.0));
+    case SIZE_LOG:
+        return (uint32_t)exp(log(opts->min_size) + u * (log(opts->max_size + 1.0) - log(opts->min_size)));
+    default:
+        return opts->min_size;
+    }
+}
+
+static inline int block_used(const struct gen_image *gen, uint32_t block) {
+    return gen->used[block / 64] >> (block % 64) & 1;
+}
+
+// Function to take the first free block at or after from, wrapping around;
+// returns FAT_EOF when the image is full
+static uint32_t take_block(struct gen_image *gen, uint32_t from) {
+    for (uint32_t i = 0; i < gen->block_count; i++) {
+        uint32_t block = from + i < gen->block_count ? from + i : from + i - gen->block_count;
+        if (!block_used(gen, block)) {
+            gen->used[block / 64] |= (uint64_t)1 << (block % 64);
+            return block;
+        }
+    }
+    return FAT_EOF;
+}
+
+// Function to allocate a chain of count blocks, starting the search at
+// *cursor. Each block follows the one before it, except that frag percent of
+// them start over at a random place; *cursor ends up after the last block.
+static int alloc_chain(struct gen_image *gen, uint32_t count, uint32_t frag, uint32_t *cursor,
+                       uint32_t *blocks) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t from = *cursor;
+        if (frag > 0 && next_random(gen) % 100 < frag) {
+            from = next_random(gen) % gen->block_count;
+        }
+
+        uint32_t block = take_block(gen, from);
+        if (block == FAT_EOF) {
+            fprintf(stderr, "Error: The image is too small for the requested files.\n");
+            return -1;
+        }
+        if (i > 0) {
+            gen->fat[blocks[i - 1]] = htonl(block);
+        }
+        blocks[i] = block;
+        *cursor = block + 1 < gen->block_count ? block + 1 : 0;
+    }
+    if (count > 0) {
+        gen->fat[blocks[count - 1]] = htonl(FAT_EOF);
+    }
+    return 0;
+}
+
+// Function to fill a directory entry with a fixed timestamp
+static void fill_entry(struct dir_entry_t *entry, uint8_t status, uint32_t start, uint32_t blocks,
+                       uint32_t size, const char *name) {
+    memset(entry, 0, sizeof(*entry));
+    entry->status = status;
+    entry->starting_block = htonl(start);
+    entry->block_count = htonl(blocks);
+    entry->file_size = htonl(size);
+    entry->create_year = entry->modify_year = htons(2024);
+    entry->create_month = entry->modify_month = 1;
+    entry->create_day = entry->modify_day = 1;
+    memcpy(entry->filename, name, strnlen(name, 30));
+    memset(entry->unused, 0xFF, sizeof(entry->unused));
+}
+
+// Function to place an entry in the next slot of a directory
+static void dir_add(struct gen_image *gen, struct gen_dir *dir, const struct dir_entry_t *entry) {
+    uint32_t per_block = gen->block_size / DIRECTORY_ENTRY_SIZE;
+    uint32_t block = dir->blocks[dir->used / per_block];
+    uint8_t *slot = gen->map + (size_t)block * gen->block_size + (dir->used % per_block) * DIRECTORY_ENTRY_SIZE;
+    memcpy(slot, entry, sizeof(*entry));
+    dir->used++;
+}
+
+// Function to build the image described by opts at path
+int generate(const char *path, const struct gen_options *opts) {
+    struct gen_image gen = {0};
+    gen.block_size = opts->block_size;
+    gen.block_count = opts->block_count;
+    gen.size = (size_t)opts->block_size * opts->block_count;
+    gen.rng = opts->seed ? opts->seed : 1;
+
+    // Directories, breadth first: 0 is the root, and the children of
+    // directory i (when it is above the bottom level) follow in order
+    uint32_t dir_count = 1, level_count = 1;
+    for (uint32_t level = 0; level < opts->depth; level++) {
+        level_count *= opts->width;
+        dir_count += level_count;
+    }
+    uint32_t parents = dir_count - level_count * (opts->depth > 0);
+
+    struct gen_dir *dirs = calloc(dir_count, sizeof(struct gen_dir));
+    uint32_t max_blocks = opts->max_size / opts->block_size + 1;
+    uint32_t *blocks = malloc(max_blocks * sizeof(uint32_t));
+    gen.used = calloc(gen.block_count / 64 + 1, sizeof(uint64_t));
+    if (!dirs || !blocks || !gen.used) {
+        perror("Memory allocation failed");
+        free(dirs);
+        free(blocks);
+        free(gen.used);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < dir_count; i++) {
+        dirs[i].entries = opts->files / dir_count + (i < opts->files % dir_count);
+        if (i < parents && opts->depth > 0) {
+            dirs[i].entries += opts->width;
+        }
+        uint32_t per_block = opts->block_size / DIRECTORY_ENTRY_SIZE;
+        dirs[i].block_count = (dirs[i].entries + per_block - 1) / per_block;
+
+        // The root cannot grow, so it gets a spare block for later puts
+        if (dirs[i].block_count == 0 || i == 0) {
+            dirs[i].block_count++;
+        }
+    }
+
+    uint32_t fat_blocks = (uint32_t)(((uint64_t)opts->block_count * sizeof(uint32_t) + opts->block_size - 1) /
+                                     opts->block_size);
+    uint32_t root_start = 1 + fat_blocks;
+    if ((uint64_t)root_start + dirs[0].block_count >= opts->block_count) {
+        fprintf(stderr, "Error: The image is too small for its FAT and root directory.\n");
+        free(dirs);
+        free(blocks);
+        free(gen.used);
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Error creating disk image");
+        free(dirs);
+        free(blocks);
+        free(gen.used);
+        return -1;
+    }
+    if (ftruncate(fd, gen.size) < 0 ||
+        (gen.map = mmap(NULL, gen.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("Error sizing disk image");
+        close(fd);
+        free(dirs);
+        free(blocks);
+        free(gen.used);
+        return -1;
+    }
+    gen.fat = (uint32_t *)(gen.map + opts->block_size);
+
+    // Superblock
+    memcpy(gen.map, "CSC360FS", 8);
+    uint16_t value16 = htons(opts->block_size);
+    uint32_t fields[5] = { htonl(opts->block_count), htonl(1), htonl(fat_blocks), htonl(root_start),
+                           htonl(dirs[0].block_count) };
+    memcpy(gen.map + 8, &value16, sizeof(value16));
+    memcpy(gen.map + 10, fields, sizeof(fields));
+
+    // The superblock and FAT are reserved, the root directory follows them
+    for (uint32_t block = 0; block < root_start; block++) {
+        gen.fat[block] = htonl(FAT_RESERVED);
+        gen.used[block / 64] |= (uint64_t)1 << (block % 64);
+    }
+    int status = 0;
+    uint32_t cursor = root_start;
+    for (uint32_t i = 0; i < dir_count && status == 0; i++) {
+        dirs[i].blocks = malloc(dirs[i].block_count * sizeof(uint32_t));
+        if (!dirs[i].blocks) {
+            perror("Memory allocation failed");
+            status = -1;
+        } else {
+            // Only the root must be contiguous; the rest fragment like files
+            status = alloc_chain(&gen, dirs[i].block_count, i == 0 ? 0 : opts->frag, &cursor, dirs[i].blocks);
+        }
+    }
+
+    // Link every directory into its parent
+    char name[32];
+    for (uint32_t i = 1; i < dir_count && status == 0; i++) {
+        struct dir_entry_t entry;
+        snprintf(name, sizeof(name), "d%u", (i - 1) % opts->width);
+        fill_entry(&entry, STATUS_DIRECTORY, dirs[i].blocks[0], dirs[i].block_count, 0, name);
+        dir_add(&gen, &dirs[(i - 1) / opts->width], &entry);
+    }
+
+    // Files, round-robin over the directories
+    uint64_t data_bytes = 0;
+    for (uint32_t i = 0; i < opts->files && status == 0; i++) {
+        uint32_t size = draw_size(&gen, opts);
+        uint32_t count = (size + opts->block_size - 1) / opts->block_size;
+        status = alloc_chain(&gen, count, opts->frag, &cursor, blocks);
+        if (status < 0) {
+            break;
+        }
+
+        for (uint32_t j = 0; j < count; j++) {
+            uint64_t *p = (uint64_t *)(gen.map + (size_t)blocks[j] * opts->block_size);
+            for (uint32_t k = 0; k < opts->block_size / sizeof(uint64_t); k++) {
+                p[k] = next_random(&gen);
+            }
+        }
+
+        struct dir_entry_t entry;
+        snprintf(name, sizeof(name), "f%u", i);
+        fill_entry(&entry, STATUS_FILE, blocks[0], count, size, name);
+        dir_add(&gen, &dirs[i % dir_count], &entry);
+        data_bytes += size;
+    }
+
+    if (status == 0 && msync(gen.map, gen.size, MS_SYNC) < 0) {
+        perror("Error writing disk image");
+        status = -1;
+    }
+    munmap(gen.map, gen.size);
+    close(fd);
+
+    if (status == 0) {
+        printf("%s: %u files in %u directories, %llu bytes of data\n", path, opts->files, dir_count,
+               (unsigned long long)data_bytes);
+    } else {
+        unlink(path);
+    }
+
+    for (uint32_t i = 0; i < dir_count; i++) {
+        free(dirs[i].blocks);
+    }
+    free(dirs);
+    free(blocks);
+    free(gen.used);
+    return status;
+}
@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "diskimg.h"
+#include "journal.h"
+#include "stats.h"
+#include "diskproto.h"
+
+// Microseconds between attempts to lock an image another tool holds
+#define LOCK_RETRY_INTERVAL 20000
+
+// Function to parse the superblock out of the mapping
+static void read_superblock(const uint8_t *buffer, struct superblock_t *sb) {
+    uint16_t value16;
+    uint32_t value32;
+
+    memcpy(&value16, buffer + 8, sizeof(uint16_t));
+    sb->block_size = ntohs(value16);
+
+    memcpy(&value32, buffer + 10, sizeof(uint32_t));
+    sb->block_count = ntohl(value32);
+
+    memcpy(&value32, buffer + 14, sizeof(uint32_t));
+    sb->fat_start = ntohl(value32);
+
+    memcpy(&value32, buffer + 18, sizeof(uint32_t));
+    sb->fat_blocks = ntohl(value32);
+
+    memcpy(&value32, buffer + 22, sizeof(uint32_t));
+    sb->root_start = ntohl(value32);
+
+    memcpy(&value32, buffer + 26, sizeof(uint32_t));
+    sb->root_blocks = ntohl(value32);
+}
+
+// Function to tell whether an image server holds the image (see
+// image_mark_served); it never lets go of it, so waiting for it is pointless
+static int image_is_served(int fd) {
+    struct flock mark = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    return fcntl(fd, F_OFD_GETLK, &mark) == 0 && mark.l_type != F_UNLCK;
+}
+
+// Function to lock the image, waiting (and saying so) while another tool
+// holds a conflicting lock, but not for an image server
+static int lock_image(int fd, const char *path, int operation) {
+    int waiting = 0;
+    int status;
+    while ((status = flock(fd, operation | LOCK_NB)) < 0 && (errno == EWOULDBLOCK || errno == EINTR)) {
+        if (image_is_served(fd)) {
+            fprintf(stderr, "Error: %s is held by the image server diskd; set %s to its socket "
+                    "to use the image through it.\n", path, DISKD_SOCKET_ENV);
+            return -1;
+        }
+        if (!waiting) {
+            fprintf(stderr, "Waiting for another tool to finish with %s...\n", path);
+            waiting = 1;
+        }
+        usleep(LOCK_RETRY_INTERVAL);
+    }
+    if (status < 0) {
+        perror("Error locking disk image");
+    }
+    return status;
+}
+
+// Function to mark an image as held by an image server for as long as it
+// stays open. The mark is an open file description lock, which flock leaves
+// alone, so tools waiting for the image can look for it.
+int image_mark_served(struct disk_image *img) {
+    struct flock mark = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    if (fcntl(img->fd, F_OFD_SETLK, &mark) < 0) {
+        perror("Error marking disk image as served");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to replay a journal left behind by a crash. A writer holds the
+// image exclusively already. A reader shares it, so it replays only if it can
+// have the image to itself for a moment; otherwise another reader is using
+// the image as it stands, and the journal is left for a later open.
+static int recover_image(struct disk_image *img, const char *path) {
+    if (img->writable) {
+        return journal_recover(path, img->journal_path, img->fd, img->size);
+    }
+    if (access(img->journal_path, F_OK) < 0) {
+        return 0;
+    }
+
+    if (flock(img->fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "Warning: %s has a journal to replay, but other tools are reading it; "
+                "its last commit may be missing until it is replayed.\n", path);
+        return 0;
+    }
+    int status = journal_recover(path, img->journal_path, -1, img->size);
+    if (lock_image(img->fd, path, LOCK_SH) < 0) {
+        return -1;
+    }
+    return status;
+}
+
+// Function to map a disk image and locate its FAT
+static int map_image(struct disk_image *img, const char *path, int writable) {
+    memset(img, 0, sizeof(*img));
+    img->writable = writable;
+
+    img->fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (img->fd < 0) {
+        perror("Error opening disk image");
+        return -1;
+    }
+
+    // A writer holds the image exclusively until it closes it, so no other
+    // tool sees a commit half done or replays its journal under it
+    if (lock_image(img->fd, path, writable ? LOCK_EX : LOCK_SH) < 0) {
+        close(img->fd);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(img->fd, &st) < 0) {
+        perror("Error reading disk image");
+        close(img->fd);
+        return -1;
+    }
+    img->size = st.st_size;
+
+    if (img->size < SUPER_BLOCK_SIZE) {
+        fprintf(stderr, "Error: %s is too small to be a disk image.\n", path);
+        close(img->fd);
+        return -1;
+    }
+
+    img->journal_path = journal_name(path);
+    if (!img->journal_path || recover_image(img, path) < 0) {
+        free(img->journal_path);
+        close(img->fd);
+        return -1;
+    }
+
+    if (writable) {
+        img->map = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, img->fd, 0);
+    } else {
+        img->map = mmap(NULL, img->size, PROT_READ, MAP_SHARED, img->fd, 0);
+    }
+    if (img->map == MAP_FAILED) {
+        perror("Error mapping disk image");
+        free(img->journal_path);
+        close(img->fd);
+        return -1;
+    }
+
+    read_superblock(img->map, &img->sb);
+
+    if (img->sb.block_size == 0 || img->sb.block_size % sizeof(uint32_t) != 0 ||
+        !image_contains(img, img->sb.fat_start, img->sb.fat_blocks) ||
+        !image_contains(img, img->sb.root_start, img->sb.root_blocks)) {
+        fprintf(stderr, "Error: %s has an invalid superblock.\n", path);
+        image_close(img);
+        return -1;
+    }
+
+    img->fat = (uint32_t *)image_block(img, img->sb.fat_start);
+    img->fat_entries = (uint32_t)((uint64_t)img->sb.fat_blocks * img->sb.block_size / sizeof(uint32_t));
+
+    if (writable) {
+        img->page_size = sysconf(_SC_PAGESIZE);
+        img->dirty = calloc(img->size / img->sb.block_size / 64 + 1, sizeof(uint64_t));
+        img->private_pages = calloc(img->size / img->page_size / 64 + 1, sizeof(uint64_t));
+        if (!img->dirty || !img->private_pages) {
+            perror("Memory allocation failed");
+            image_close(img);
+            return -1;
+        }
+    }
+
+    sums_open(img, path);
+    return 0;
+}
+
+int image_open(struct disk_image *img, const char *path, int writable) {
+    enum stats_phase phase = stats_enter(PHASE_SUPERBLOCK);
+    int status = map_image(img, path, writable);
+    stats_enter(phase);
+    return status;
+}
+
+void image_close(struct disk_image *img) {
+    if (img->dirty) {
+        journal_commit(img);
+    }
+    free(img->dirty);
+    free(img->private_pages);
+    img->dirty = img->private_pages = NULL;
+
+    if (img->map && img->map != MAP_FAILED) {
+        munmap(img->map, img->size);
+    }
+    if (img->fd >= 0) {
+        close(img->fd);
+    }
+    free(img->journal_path);
+    img->journal_path = NULL;
+    sums_close(img);
+    img->map = NULL;
+    img->fd = -1;
+}
+
+void image_mark_dirty(struct disk_image *img, uint32_t block) {
+    if (!img->dirty) {
+        return;
+    }
+    img->dirty[block / 64] |= (uint64_t)1 << (block % 64);
+
+    // The write that dirtied the block gave us a private copy of its pages
+    size_t first_page = (size_t)block * img->sb.block_size / img->page_size;
+    size_t last_page = (((size_t)block + 1) * img->sb.block_size - 1) / img->page_size;
+    for (size_t page = first_page; page <= last_page && page * img->page_size < img->size; page++) {
+        img->private_pages[page / 64] |= (uint64_t)1 << (page % 64);
+    }
+}
+
+void image_dirty_range(struct disk_image *img, const void *ptr, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    size_t offset = (const uint8_t *)ptr - img->map;
+    uint32_t first = offset / img->sb.block_size;
+    uint32_t last = (offset + len - 1) / img->sb.block_size;
+    for (uint32_t block = first; block <= last; block++) {
+        image_mark_dirty(img, block);
+    }
+}
+
+static int pwrite_full(int fd, const uint8_t *p, size_t len, off_t offset) {
+    stats_access(offset, len);
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, offset);
+        if (written < 0) {
+            perror("Error writing disk image");
+            return -1;
+        }
+        stats_write(written);
+        p += written;
+        offset += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Function to write dirty metadata back, one write per run of dirty blocks
+int image_flush(struct disk_image *img) {
+    if (!img->dirty) {
+        return 0;
+    }
+
+    uint32_t nblocks = img->size / img->sb.block_size;
+    uint32_t block = 0;
+    int status = 0;
+
+    while (block < nblocks) {
+        // Skip clean blocks a word at a time
+        if (block % 64 == 0 && img->dirty[block / 64] == 0) {
+            block += 64;
+            continue;
+        }
+        if (!(img->dirty[block / 64] >> (block % 64) & 1)) {
+            block++;
+            continue;
+        }
+
+        uint32_t start = block;
+        while (block < nblocks && img->dirty[block / 64] >> (block % 64) & 1) {
+            img->dirty[block / 64] &= ~((uint64_t)1 << (block % 64));
+            block++;
+        }
+
+        size_t len = (size_t)(block - start) * img->sb.block_size;
+        if (pwrite_full(img->fd, image_block(img, start), len, (off_t)start * img->sb.block_size) < 0) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+// Function to write file data into the image
+int image_write(struct disk_image *img, uint32_t block, const void *buf, size_t len) {
+    off_t offset = (off_t)block * img->sb.block_size;
+
+    if (offset + len > img->size) {
+        fprintf(stderr, "Error: Write past the end of the disk image.\n");
+        return -1;
+    }
+
+    sums_dirty(img);
+    if (pwrite_full(img->fd, buf, len, offset) < 0) {
+        return -1;
+    }
+
+    image_sync_private(img, offset, buf, len);
+    return 0;
+}
+
+// Function to zero file data in the image, as a hole where the filesystem
+// can punch one and with written zeros where it cannot
+int image_zero(struct disk_image *img, uint32_t block, uint32_t count) {
+    off_t offset = (off_t)block * img->sb.block_size;
+    size_t len = (size_t)count * img->sb.block_size;
+
+    if (offset + len > img->size) {
+        fprintf(stderr, "Error: Write past the end of the disk image.\n");
+        return -1;
+    }
+
+    stats_access(offset, len);
+    sums_dirty(img);
+    if (fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            perror("Error punching a hole in the disk image");
+            return -1;
+        }
+
+        static const uint8_t zeros[1 << 16];
+        for (size_t done = 0; done < len; done += sizeof(zeros)) {
+            size_t chunk = len - done < sizeof(zeros) ? len - done : sizeof(zeros);
+            if (pwrite_full(img->fd, zeros, chunk, offset + done) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    image_sync_private(img, offset, NULL, len);
+    return 0;
+}
+
+// Function to copy data just written to the file into our private pages
+void image_sync_private(struct disk_image *img, off_t offset, const void *buf, size_t len) {
+    // Pages we hold a private copy of no longer see the file, so keep them in step
+    if (img->private_pages) {
+        size_t end = offset + len;
+        for (size_t page = offset / img->page_size; page * img->page_size < end; page++) {
+            if (!(img->private_pages[page / 64] >> (page % 64) & 1)) {
+                continue;
+            }
+            size_t from = page * img->page_size > (size_t)offset ? page * img->page_size : (size_t)offset;
+            size_t to = (page + 1) * img->page_size < end ? (page + 1) * img->page_size : end;
+            if (buf) {
+                memcpy(img->map + from, (const uint8_t *)buf + (from - offset), to - from);
+            } else {
+                memset(img->map + from, 0, to - from);
+            }
+        }
+    }
+
+    sums_update(img, offset, buf, len);
+}
+
+int write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            return -1;
+        }
+        stats_write(written);
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+ssize_t read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t got = read(fd, p + total, len - total);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        stats_read(got);
+        if (got == 0) {
+            break;
+        }
+        total += got;
+    }
+    return total;
+}
+
+// Errors that mean the copy itself failed, rather than that the kernel
+// cannot do it this way for these two files
+static int copy_error_is_fatal(int err) {
+    return err == EIO || err == ENOSPC || err == EDQUOT || err == EFBIG || err == EPIPE;
+}
+
+// Function to copy image data out through the kernel where possible
+int image_copy_out(const struct disk_image *img, uint32_t block, size_t len,
+                   int out_fd, enum copy_method *method) {
+    off_t offset = (off_t)block * img->sb.block_size;
+
+    if (offset + len > img->size) {
+        fprintf(stderr, "Error: Read past the end of the disk image.\n");
+        return -1;
+    }
+    stats_access(offset, len);
+
+    while (len > 0) {
+        ssize_t copied;
+
+        if (*method == COPY_FILE_RANGE) {
+            loff_t in_offset = offset;
+            copied = copy_file_range(img->fd, &in_offset, out_fd, NULL, len, 0);
+        } else if (*method == COPY_SENDFILE) {
+            off_t in_offset = offset;
+            copied = sendfile(out_fd, img->fd, &in_offset, len);
+        } else {
+            return write_full(out_fd, img->map + offset, len);
+        }
+
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied < 0 && copy_error_is_fatal(errno)) {
+            return -1;
+        }
+        if (copied <= 0) {
+            (*method)++; // The kernel refused; fall back to the next method
+            continue;
+        }
+
+        stats_write(copied);
+        offset += copied;
+        len -= copied;
+    }
+    return 0;
+}
+
+int extent_list_add(struct extent_list *list, uint32_t start, uint32_t count) {
+    if (list->count > 0) {
+        struct extent *last = &list->runs[list->count - 1];
+        if (last->start + last->count == start) {
+            last->count += count;
+            return 0;
+        }
+    }
+
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        struct extent *runs = realloc(list->runs, capacity * sizeof(struct extent));
+        if (!runs) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        list->runs = runs;
+        list->capacity = capacity;
+    }
+
+    list->runs[list->count].start = start;
+    list->runs[list->count].count = count;
+    list->count++;
+    return 0;
+}
+
+// Function to resolve a FAT chain into runs of consecutive blocks
+int chain_extents(const struct disk_image *img, uint32_t start_block, uint32_t max_blocks,
+                  struct extent_list *list) {
+    uint32_t current_block = start_block;
+    uint32_t i;
+
+    for (i = 0; i < max_blocks && current_block != FAT_EOF; i++) {
+        if (current_block >= img->fat_entries || !image_contains(img, current_block, 1)) {
+            fprintf(stderr, "Error: File chain points outside the disk image.\n");
+            return -1;
+        }
+        if (extent_list_add(list, current_block, 1) < 0) {
+            return -1;
+        }
+        current_block = fat_get(img, current_block);
+    }
+    stats_fat(i);
+    return 0;
+}
+
+// Function to write a FAT chain through the runs of list, in order. Entries
+// that already hold the right link are left alone, so relinking a chain
+// dirties only the FAT blocks that change.
+void chain_link(struct disk_image *img, const struct extent_list *list) {
+    uint32_t previous_block = FAT_EOF;
+
+    for (size_t i = 0; i < list->count; i++) {
+        for (uint32_t block = list->runs[i].start; block < list->runs[i].start + list->runs[i].count; block++) {
+            if (previous_block != FAT_EOF && fat_get(img, previous_block) != block) {
+                fat_set(img, previous_block, block); // Link previous block to current
+            }
+            previous_block = block;
+        }
+    }
+
+    if (previous_block != FAT_EOF && fat_get(img, previous_block) != FAT_EOF) {
+        fat_set(img, previous_block, FAT_EOF); // Mark the last block as EOF
+    }
+}
+
+void extent_list_free(struct extent_list *list) {
+    free(list->runs);
+    list->runs = NULL;
+    list->count = list->capacity = 0;
+}
+
+uint32_t dir_next_block(const struct disk_image *img, uint32_t block) {
+    uint32_t next = (block < img->fat_entries) ? fat_get(img, block) : FAT_FREE;
+    stats_fat(1);
+
+    if (next == FAT_EOF) {
+        return FAT_EOF;
+    }
+
+    // Directories laid out without a chain in the FAT are contiguous
+    if (next == FAT_FREE || next == FAT_RESERVED || next >= img->fat_entries) {
+        next = block + 1;
+    }
+    return image_contains(img, next, 1) ? next : FAT_EOF;
+}
+
+void dir_iter_init(struct dir_iter *it, const struct disk_image *img,
+                   uint32_t start_block, uint32_t block_count) {
+    it->img = img;
+    it->index = 0;
+    if (block_count == 0 || !image_contains(img, start_block, 1)) {
+        it->block = FAT_EOF;
+        it->blocks_left = 0;
+    } else {
+        it->block = start_block;
+        it->blocks_left = block_count - 1;
+    }
+}
+
+// Function to step to the next directory entry, moving along the chain
+// whenever a block is used up
+struct dir_entry_t *dir_iter_next(struct dir_iter *it) {
+    uint32_t per_block = it->img->sb.block_size / DIRECTORY_ENTRY_SIZE;
+
+    while (it->block != FAT_EOF) {
+        if (it->index < per_block) {
+            return (struct dir_entry_t *)image_block(it->img, it->block) + it->index++;
+        }
+
+        it->index = 0;
+        if (it->blocks_left == 0) {
+            it->block = FAT_EOF;
+            break;
+        }
+        it->blocks_left--;
+        it->block = dir_next_block(it->img, it->block);
+    }
+    return NULL;
+}
+
+struct dir_entry_t *dir_find(const struct disk_image *img, uint32_t start_block,
+                             uint32_t block_count, const char *name, enum entry_kind kind) {
+    struct dir_iter it;
+    struct dir_entry_t *entry;
+
+    dir_iter_init(&it, img, start_block, block_count);
+    while ((entry = dir_iter_next(&it))) {
+        if (entry_in_use(entry) && entry_is_kind(entry, kind) && entry_name_eq(entry, name)) {
+            return entry; // Stop reading as soon as the name turns up
+        }
+    }
+    return NULL;
+}
+
+struct dir_entry_t *dir_free_slot(const struct disk_image *img, uint32_t start_block,
+                                  uint32_t block_count) {
+    struct dir_iter it;
+    struct dir_entry_t *entry;
+
+    dir_iter_init(&it, img, start_block, block_count);
+    while ((entry = dir_iter_next(&it))) {
+        if (!entry_in_use(entry)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,255 @@
+#ifndef DISKIMG_H
+#define DISKIMG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sums.h"
+
+#define SUPER_BLOCK_SIZE 512
+#define DIRECTORY_ENTRY_SIZE 64
+
+// FAT entry values
+#define FAT_FREE     0x00000000
+#define FAT_RESERVED 0x00000001
+#define FAT_EOF      0xFFFFFFFF
+
+// Directory entry status values
+#define STATUS_FREE      0x00
+#define STATUS_FILE      0x03
+#define STATUS_DIRECTORY 0x05
+#define STATUS_UNUSED    0xFF
+
+// Directory entry structure (all multi-byte fields are big-endian on disk)
+struct __attribute__((packed)) dir_entry_t {
+    uint8_t status;
+    uint32_t starting_block;
+    uint32_t block_count;
+    uint32_t file_size;
+    uint16_t create_year;
+    uint8_t create_month;
+    uint8_t create_day;
+    uint8_t create_hour;
+    uint8_t create_minute;
+    uint8_t create_second;
+    uint16_t modify_year;
+    uint8_t modify_month;
+    uint8_t modify_day;
+    uint8_t modify_hour;
+    uint8_t modify_minute;
+    uint8_t modify_second;
+    char filename[31];
+    uint8_t unused[6];
+};
+
+// A run of consecutive blocks
+struct extent {
+    uint32_t start;
+    uint32_t count;
+};
+
+// A file's FAT chain resolved into contiguous runs
+struct extent_list {
+    struct extent *runs;
+    size_t count;
+    size_t capacity;
+};
+
+// Ways of moving image data to an output fd, fastest first
+enum copy_method {
+    COPY_FILE_RANGE,    // copy_file_range: in-kernel, reflinks where supported
+    COPY_SENDFILE,      // sendfile: in-kernel, also works for pipes and sockets
+    COPY_WRITE          // write() straight out of the mapping
+};
+
+// Streams a directory's entries one block at a time, following the
+// directory's FAT chain, so memory use does not depend on its size
+struct dir_iter {
+    const struct disk_image *img;
+    uint32_t block;             // block being read, FAT_EOF once finished
+    uint32_t blocks_left;       // blocks still to come after this one
+    uint32_t index;             // next entry within the block
+};
+
+// Superblock fields, converted to host byte order
+struct superblock_t {
+    uint16_t block_size;
+    uint32_t block_count;
+    uint32_t fat_start;
+    uint32_t fat_blocks;
+    uint32_t root_start;
+    uint32_t root_blocks;
+};
+
+// A disk image mapped into memory. The FAT and directories are views into
+// the mapping, so nothing is copied when the tools read them.
+//
+// Writable images are mapped copy-on-write: metadata changes made through
+// the mapping stay private until image_flush() writes the dirty blocks back,
+// coalescing neighbouring blocks into one write. File data bypasses the
+// mapping and goes straight to the file with image_write(). Metadata reaches
+// the file through the journal (see journal.h).
+struct disk_image {
+    int fd;
+    int writable;
+    uint8_t *map;
+    size_t size;
+    struct superblock_t sb;
+    uint32_t *fat;          // big-endian FAT entries, inside the mapping
+    uint32_t fat_entries;
+    uint64_t *dirty;        // per block: changed in the mapping, not yet flushed
+    uint64_t *private_pages; // per page: the mapping holds its own copy
+    size_t page_size;
+    char *journal_path;     // <image>.journal
+    struct block_sums sums; // <image>.sums, when the image has a checksum index
+};
+
+// Map the image at path, first replaying any journal an interrupted commit
+// left behind; returns 0 on success, -1 (after reporting) on error
+int image_open(struct disk_image *img, const char *path, int writable);
+
+// Unmap the image, committing any dirty metadata through the journal
+void image_close(struct disk_image *img);
+
+// Mark an open image as held by an image server, so tools fail instead of
+// waiting for it
+int image_mark_served(struct disk_image *img);
+
+// Record that the mapping was changed in the given block, or in the blocks
+// covering [ptr, ptr + len); no-ops on read-only images
+void image_mark_dirty(struct disk_image *img, uint32_t block);
+void image_dirty_range(struct disk_image *img, const void *ptr, size_t len);
+
+// Write the dirty blocks back to the image file, with no ordering or syncing;
+// journal_commit() is the durable way. Returns -1 on error
+int image_flush(struct disk_image *img);
+
+// Write len bytes of file data starting at the given block
+int image_write(struct disk_image *img, uint32_t block, const void *buf, size_t len);
+
+// Zero count blocks of file data starting at block, leaving a hole in the
+// image file where the filesystem supports it
+int image_zero(struct disk_image *img, uint32_t block, uint32_t count);
+
+// Bring the mapping and the checksum index in step with len bytes already
+// written to the image file at offset by other means (pages still shared see
+// the write anyway); a NULL buf stands for zeros
+void image_sync_private(struct disk_image *img, off_t offset, const void *buf, size_t len);
+
+// Write all of buf to fd, retrying short writes
+int write_full(int fd, const void *buf, size_t len);
+
+// Read until buf is full or the input ends, retrying short reads (as pipes
+// give); returns the number of bytes read, or -1 on error
+ssize_t read_full(int fd, void *buf, size_t len);
+
+// Copy len bytes starting at block to out_fd's current offset. *method starts
+// at COPY_FILE_RANGE and is downgraded whenever the kernel refuses a faster way.
+int image_copy_out(const struct disk_image *img, uint32_t block, size_t len,
+                   int out_fd, enum copy_method *method);
+
+// Follow the FAT chain from start_block for at most max_blocks blocks,
+// appending each contiguous run to list; returns -1 if the chain is invalid
+int chain_extents(const struct disk_image *img, uint32_t start_block, uint32_t max_blocks,
+                  struct extent_list *list);
+void extent_list_free(struct extent_list *list);
+
+// Append a run to list, merging it into the last run when they touch
+int extent_list_add(struct extent_list *list, uint32_t start, uint32_t count);
+
+// Link the runs of list into one FAT chain ending in FAT_EOF
+void chain_link(struct disk_image *img, const struct extent_list *list);
+
+// Start iterating over the directory of block_count blocks at start_block
+void dir_iter_init(struct dir_iter *it, const struct disk_image *img,
+                   uint32_t start_block, uint32_t block_count);
+
+// Returns the next entry, used or not, or NULL at the end of the directory
+struct dir_entry_t *dir_iter_next(struct dir_iter *it);
+
+// Returns the block after block in a directory's chain, or FAT_EOF
+uint32_t dir_next_block(const struct disk_image *img, uint32_t block);
+
+// Which entries a lookup by name may return. A file and a directory can
+// share a name, so path components that must be directories look for
+// ENTRY_DIR and skip any file of the same name.
+enum entry_kind { ENTRY_ANY, ENTRY_FILE, ENTRY_DIR };
+
+// Find the first in-use entry of the given kind called name in a directory,
+// or NULL
+struct dir_entry_t *dir_find(const struct disk_image *img, uint32_t start_block,
+                             uint32_t block_count, const char *name, enum entry_kind kind);
+
+// Find an unused slot in a directory, or NULL if it is full
+struct dir_entry_t *dir_free_slot(const struct disk_image *img, uint32_t start_block,
+                                  uint32_t block_count);
+
+// Check whether len bytes at p are all zero
+static inline int bytes_are_zero(const uint8_t *p, size_t len) {
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+// Check that blocks [block, block + count) lie inside the image
+static inline int image_contains(const struct disk_image *img, uint32_t block, uint32_t count) {
+    return ((uint64_t)block + count) * img->sb.block_size <= img->size;
+}
+
+static inline uint8_t *image_block(const struct disk_image *img, uint32_t block) {
+    return img->map + (size_t)block * img->sb.block_size;
+}
+
+static inline uint32_t fat_get(const struct disk_image *img, uint32_t block) {
+    return ntohl(img->fat[block]);
+}
+
+static inline void fat_set(struct disk_image *img, uint32_t block, uint32_t value) {
+    img->fat[block] = htonl(value);
+    image_mark_dirty(img, img->sb.fat_start + (uint32_t)((uint64_t)block * sizeof(uint32_t) / img->sb.block_size));
+}
+
+static inline int entry_in_use(const struct dir_entry_t *entry) {
+    return entry->status != STATUS_FREE && entry->status != STATUS_UNUSED;
+}
+
+static inline int entry_is_dir(const struct dir_entry_t *entry) {
+    return entry->status == STATUS_DIRECTORY;
+}
+
+static inline int entry_is_kind(const struct dir_entry_t *entry, enum entry_kind kind) {
+    return kind == ENTRY_ANY || (kind == ENTRY_DIR) == entry_is_dir(entry);
+}
+
+static inline uint32_t entry_start_block(const struct dir_entry_t *entry) {
+    return ntohl(entry->starting_block);
+}
+
+static inline uint32_t entry_block_count(const struct dir_entry_t *entry) {
+    return ntohl(entry->block_count);
+}
+
+static inline uint32_t entry_file_size(const struct dir_entry_t *entry) {
+    return ntohl(entry->file_size);
+}
+
+// Filenames are at most 30 characters and are not always null-terminated
+static inline int entry_name_len(const struct dir_entry_t *entry) {
+    return (int)strnlen(entry->filename, 30);
+}
+
+static inline int entry_name_eq(const struct dir_entry_t *entry, const char *name) {
+    size_t len = strnlen(entry->filename, 30);
+    return strlen(name) == len && memcmp(entry->filename, name, len) == 0;
+}
+
+// Whether an entry's name is safe to use as one host path component: not
+// empty, not "." or "..", and with no '/' in it
+static inline int entry_name_is_safe(const struct dir_entry_t *entry) {
+    int len = entry_name_len(entry);
+    return len > 0 && !memchr(entry->filename, '/', len) &&
+           !entry_name_eq(entry, ".") && !entry_name_eq(entry, "..");
+}
+
+#endif
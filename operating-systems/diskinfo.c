@@ -1,120 +1,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <string.h>
-#include <arpa/inet.h>
+#include <unistd.h>
+#include <getopt.h>
 
-#define SUPER_BLOCK_SIZE 512
-
-// Function prototypes
-void read_superblock(FILE *fp, uint16_t *block_size, uint32_t *block_count, 
-                     uint32_t *fat_start, uint32_t *fat_blocks, 
-                     uint32_t *root_start, uint32_t *root_blocks);
-void read_fat(FILE *fp, uint32_t fat_start, uint32_t fat_blocks, 
-              uint32_t block_size, uint32_t *free_blocks, 
-              uint32_t *reserved_blocks, uint32_t *allocated_blocks);
+#include "diskimg.h"
+#include "imginfo.h"
+#include "diskproto.h"
+#include "stats.h"
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <disk image>\n", argv[0]);
-        return EXIT_FAILURE;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int show_frag = 0;
+    int use_summary = 1;
+    int opt;
+    static const struct option long_options[] = { STATS_LONG_OPTION, { NULL, 0, NULL, 0 } };
+
+    while ((opt = getopt_long(argc, argv, "j:fs", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 'f':
+            show_frag = 1;
+            break;
+        case 's':
+            use_summary = 0;
+            break;
+        case STATS_OPTION:
+            if (stats_enable(optarg) < 0) {
+                workers = -1;
+            }
+            break;
+        default:
+            workers = -1;
+            break;
+        }
     }
 
-    FILE *fp = fopen(argv[1], "rb");
-    if (!fp) {
-        perror("Error opening file");
+    if (argc - optind != 1 || workers < 1) {
+        fprintf(stderr, "Usage: %s [-j workers] [-f] [-s] [--stats[=json]] <disk image>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    uint16_t block_size;
-    uint32_t block_count, fat_start, fat_blocks, root_start, root_blocks;
-
-    // Read superblock information
-    read_superblock(fp, &block_size, &block_count, &fat_start, &fat_blocks, &root_start, &root_blocks);
-
-    // Print superblock information
-    printf("Super block information:\n");
-    printf("Block size: %u\n", block_size);
-    printf("Block count: %u\n", block_count);
-    printf("FAT starts: %u\n", fat_start);
-    printf("FAT blocks: %u\n", fat_blocks);
-    printf("Root directory start: %u\n", root_start);
-    printf("Root directory blocks: %u\n", root_blocks);
-
-    // Variables for FAT information
-    uint32_t free_blocks = 0, reserved_blocks = 0, allocated_blocks = 0;
-
-    // Read FAT information
-    read_fat(fp, fat_start, fat_blocks, block_size, &free_blocks, &reserved_blocks, &allocated_blocks);
-
-    // Print FAT information
-    printf("\nFAT information:\n");
-    printf("Free Blocks: %u\n", free_blocks);
-    printf("Reserved Blocks: %u\n", reserved_blocks);
-    printf("Allocated Blocks: %u\n", allocated_blocks);
-
-    fclose(fp);
-    return EXIT_SUCCESS;
-}
-
-// Function to read the superblock
-void read_superblock(FILE *fp, uint16_t *block_size, uint32_t *block_count, 
-                     uint32_t *fat_start, uint32_t *fat_blocks, 
-                     uint32_t *root_start, uint32_t *root_blocks) {
-    uint8_t buffer[SUPER_BLOCK_SIZE];
-
-    fread(buffer, 1, SUPER_BLOCK_SIZE, fp);
-
-    memcpy(block_size, buffer + 8, sizeof(uint16_t));
-    *block_size = ntohs(*block_size);
-
-    memcpy(block_count, buffer + 10, sizeof(uint32_t));
-    *block_count = ntohl(*block_count);
-
-    memcpy(fat_start, buffer + 14, sizeof(uint32_t));
-    *fat_start = ntohl(*fat_start); 
-
-    memcpy(fat_blocks, buffer + 18, sizeof(uint32_t));
-    *fat_blocks = ntohl(*fat_blocks);
-
-    memcpy(root_start, buffer + 22, sizeof(uint32_t));
-    *root_start = ntohl(*root_start); 
-
-    memcpy(root_blocks, buffer + 26, sizeof(uint32_t));
-    *root_blocks = ntohl(*root_blocks);
-}
-
-// Function to read the FAT
-void read_fat(FILE *fp, uint32_t fat_start, uint32_t fat_blocks, 
-              uint32_t block_size, uint32_t *free_blocks, 
-              uint32_t *reserved_blocks, uint32_t *allocated_blocks) {
-    uint32_t fat_size = fat_blocks * block_size;
-    uint8_t *fat = malloc(fat_size);
-
-    if (!fat) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+    // A running image server does the work if it has the image
+    const char *args[] = { argv[optind] };
+    int served = diskd_call(DISKD_INFO, (show_frag ? DISKD_INFO_FRAG : 0) | (use_summary ? 0 : DISKD_INFO_RESCAN),
+                            workers, 0, 1, args);
+    if (served != DISKD_UNAVAILABLE) {
+        return served < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 
-    // Seek to FAT start and read FAT into memory
-    fseek(fp, fat_start * block_size, SEEK_SET);
-    fread(fat, fat_size, 1, fp);
-
-    // Parse FAT entries
-    for (uint32_t i = 0; i < fat_size / 4; i++) {
-        uint32_t entry;
-        memcpy(&entry, fat + i * 4, sizeof(uint32_t));
-
-        entry = ntohl(entry); // Convert to host byte order
-
-        if (entry == 0x00000000) {
-           (*free_blocks)++;
-       } else if (entry == 0x00000001) {
-           (*reserved_blocks)++;
-       } else if (entry >= 0x00000002 && entry <= 0xFFFFFFFF) {
-            (*allocated_blocks)++;
-        }
+    struct disk_image img;
+    if (image_open(&img, argv[optind], 0) < 0) {
+        return EXIT_FAILURE;
     }
 
-    free(fat);
+    print_image_info(&img, workers, show_frag, use_summary);
+
+    image_close(&img);
+    stats_report("diskinfo");
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "diskproto.h"
+#include "stats.h"
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t got = recv(fd, p, len, MSG_WAITALL);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// Function to connect to the server socket; returns -1 if nothing listens there
+static int diskd_connect(const char *socket_path) {
+    struct sockaddr_un addr = {0};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function to have the server carry out a request
+int diskd_call(uint8_t op, uint16_t options, uint32_t value, uint32_t depth, int argc,
+               const char *const argv[]) {
+    const char *socket_path = getenv(DISKD_SOCKET_ENV);
+    if (!socket_path || !*socket_path || argc < 1 || argc > DISKD_MAX_ARGS) {
+        return DISKD_UNAVAILABLE;
+    }
+
+    // The server knows its images by absolute path
+    char *image_path = realpath(argv[0], NULL);
+    if (!image_path) {
+        return DISKD_UNAVAILABLE;
+    }
+
+    // Header, then each argument as a length and its bytes
+    size_t size = sizeof(struct diskd_request);
+    for (int i = 0; i < argc; i++) {
+        const char *arg = i == 0 ? image_path : argv[i];
+        size += sizeof(uint16_t) + strlen(arg);
+        if (strlen(arg) > UINT16_MAX) {
+            free(image_path);
+            return DISKD_UNAVAILABLE;
+        }
+    }
+    uint8_t *message = malloc(size);
+    if (!message) {
+        free(image_path);
+        return DISKD_UNAVAILABLE;
+    }
+
+    // With --stats the server collects them and reports to our stderr
+    if (io_stats.format != STATS_OFF) {
+        options |= DISKD_STATS | (io_stats.format == STATS_JSON ? DISKD_STATS_JSON : 0);
+    }
+
+    struct diskd_request request = { htonl(DISKD_MAGIC), op, argc, htons(options), htonl(value), htonl(depth) };
+    memcpy(message, &request, sizeof(request));
+    size_t pos = sizeof(request);
+    for (int i = 0; i < argc; i++) {
+        const char *arg = i == 0 ? image_path : argv[i];
+        uint16_t len = htons(strlen(arg));
+        memcpy(message + pos, &len, sizeof(len));
+        memcpy(message + pos + sizeof(len), arg, strlen(arg));
+        pos += sizeof(len) + strlen(arg);
+    }
+    free(image_path);
+
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int sock = cwd < 0 ? -1 : diskd_connect(socket_path);
+    if (sock < 0) {
+        if (cwd >= 0) {
+            close(cwd);
+        }
+        free(message);
+        return DISKD_UNAVAILABLE;
+    }
+
+    // The descriptors go with the first byte of the request
+    int fds[DISKD_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = { message, 1 };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fflush(stdout);
+    int status = DISKD_UNAVAILABLE;
+    struct diskd_reply reply;
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 && send_all(sock, message + 1, size - 1) == 0) {
+        if (recv_all(sock, &reply, sizeof(reply)) == 0 && ntohl(reply.magic) == DISKD_MAGIC) {
+            status = (int32_t)ntohl(reply.status);
+            if (status == DISKD_REFUSED) {
+                fprintf(stderr, "Error: The image server at %s runs as another user.\n", socket_path);
+                status = -1;
+            }
+        } else {
+            fprintf(stderr, "Error: Lost the connection to the image server.\n");
+            status = -1;
+        }
+    }
+
+    close(sock);
+    close(cwd);
+    free(message);
+    return status;
+}
+
+void diskd_free_args(char *args[DISKD_MAX_ARGS], int argc) {
+    for (int i = 0; i < argc && i < DISKD_MAX_ARGS; i++) {
+        free(args[i]);
+        args[i] = NULL;
+    }
+}
+
+// Function to tell how long the request at the start of buf is: its size
+// once enough of it has arrived to tell, 0 before that, or -1 if it is not a
+// request at all
+static ssize_t request_length(const uint8_t *buf, size_t len) {
+    struct diskd_request request;
+    if (len < sizeof(request)) {
+        return 0;
+    }
+    memcpy(&request, buf, sizeof(request));
+    if (ntohl(request.magic) != DISKD_MAGIC || request.argc < 1 || request.argc > DISKD_MAX_ARGS) {
+        return -1;
+    }
+
+    size_t pos = sizeof(request);
+    for (int i = 0; i < request.argc; i++) {
+        uint16_t arg_len;
+        if (len < pos + sizeof(arg_len)) {
+            return 0;
+        }
+        memcpy(&arg_len, buf + pos, sizeof(arg_len));
+        pos += sizeof(arg_len) + ntohs(arg_len);
+    }
+    return pos <= len ? (ssize_t)pos : 0;
+}
+
+// Function to take the descriptors that came with a read, keeping at most
+// DISKD_FDS of them; returns -1 if there were more
+static int take_fds(struct diskd_receiver *rx, struct msghdr *msg) {
+    int status = (msg->msg_flags & MSG_CTRUNC) ? -1 : 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (rx->nfds < DISKD_FDS) {
+                rx->fds[rx->nfds++] = fd;
+            } else {
+                close(fd);
+                status = -1;
+            }
+        }
+    }
+    return status;
+}
+
+// Function to read what has arrived of a request and, once all of it is in,
+// unpack it
+int diskd_receive(int conn, struct diskd_receiver *rx, struct diskd_request *request,
+                  char *args[DISKD_MAX_ARGS], int fds[DISKD_FDS]) {
+    ssize_t length;
+
+    while ((length = request_length(rx->buf, rx->len)) == 0) {
+        if (rx->len == rx->capacity) {
+            size_t capacity = rx->capacity ? rx->capacity * 2 : 256;
+            uint8_t *buf = realloc(rx->buf, capacity);
+            if (!buf) {
+                return -1;
+            }
+            rx->buf = buf;
+            rx->capacity = capacity;
+        }
+
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int) * DISKD_FDS)];
+        } control;
+
+        struct iovec iov = { rx->buf + rx->len, rx->capacity - rx->len };
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t got = recvmsg(conn, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (got <= 0 || take_fds(rx, &msg) < 0) {
+            return -1;
+        }
+        rx->len += got;
+    }
+
+    // The descriptors go with the first byte, so they are all in by now
+    if (length < 0 || rx->nfds != DISKD_FDS) {
+        return -1;
+    }
+
+    memcpy(request, rx->buf, sizeof(*request));
+    memset(args, 0, sizeof(char *) * DISKD_MAX_ARGS);
+    size_t pos = sizeof(*request);
+    for (int i = 0; i < request->argc; i++) {
+        uint16_t len;
+        memcpy(&len, rx->buf + pos, sizeof(len));
+        pos += sizeof(len);
+        args[i] = malloc(ntohs(len) + 1);
+        if (!args[i]) {
+            diskd_free_args(args, DISKD_MAX_ARGS);
+            return -1;
+        }
+        memcpy(args[i], rx->buf + pos, ntohs(len));
+        args[i][ntohs(len)] = '\0';
+        pos += ntohs(len);
+    }
+
+    memcpy(fds, rx->fds, sizeof(rx->fds));
+    rx->nfds = 0;
+    request->options = ntohs(request->options);
+    request->value = ntohl(request->value);
+    request->depth = ntohl(request->depth);
+    return 1;
+}
+
+void diskd_receiver_free(struct diskd_receiver *rx) {
+    for (int i = 0; i < rx->nfds; i++) {
+        close(rx->fds[i]);
+    }
+    rx->nfds = 0;
+    free(rx->buf);
+    rx->buf = NULL;
+    rx->len = rx->capacity = 0;
+}
+
+int diskd_reply(int conn, int status) {
+    struct diskd_reply reply = { htonl(DISKD_MAGIC), (int32_t)htonl(status) };
+    return send(conn, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(reply) ? 0 : -1;
+}
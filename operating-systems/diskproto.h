@@ -0,0 +1,94 @@
+#ifndef DISKPROTO_H
+#define DISKPROTO_H
+
+#include <stdint.h>
+
+// Requests to the image server (diskd) over a Unix domain socket. A request
+// is a fixed header followed by argc strings, each a big-endian 16-bit length
+// and its bytes; the first string is the image's absolute path. The client's
+// stdin, stdout, stderr and working directory travel with the header as
+// SCM_RIGHTS descriptors, so the server reads and writes exactly what the
+// tool itself would have. The reply carries the result. The server opens host
+// paths with its own credentials, so it refuses clients running as any other
+// user.
+
+#define DISKD_MAGIC      0x44534B44  // "DSKD"
+#define DISKD_MAX_ARGS   4
+#define DISKD_FDS        4           // stdin, stdout, stderr, working directory
+#define DISKD_SOCKET_ENV "DISKD_SOCKET"
+
+enum diskd_op {
+    DISKD_INFO = 1,     // value: workers
+    DISKD_LIST,         // value: enum list_format; args: directory
+    DISKD_GET,          // value: workers; args: file and output, or directory and host directory
+    DISKD_PUT,          // value: group size; args: input file and destination, or manifest
+    DISKD_DEFRAG,       // value: workers
+    DISKD_FSCK,         // value: workers
+    DISKD_VERIFY        // value: workers; args: image path and host path, or none to build the index
+};
+
+// Option bits
+#define DISKD_INFO_FRAG      0x01
+#define DISKD_INFO_RESCAN    0x02
+#define DISKD_LIST_RECURSIVE 0x01
+#define DISKD_GET_RECURSIVE  0x01
+#define DISKD_GET_SPARSE     0x02
+#define DISKD_PUT_BATCH      0x01
+#define DISKD_PUT_SPARSE     0x02
+#define DISKD_DEFRAG_DRY_RUN 0x01
+#define DISKD_FSCK_REPAIR    0x01
+#define DISKD_VERIFY_BUILD   0x01
+#define DISKD_STATS          0x40    // any op: report --stats on the client's stderr
+#define DISKD_STATS_JSON     0x80
+
+// All fields are big-endian
+struct __attribute__((packed)) diskd_request {
+    uint32_t magic;
+    uint8_t op;
+    uint8_t argc;
+    uint16_t options;
+    uint32_t value;
+    uint32_t depth;             // GET and PUT: io_uring queue depth, 0 for none
+};
+
+struct __attribute__((packed)) diskd_reply {
+    uint32_t magic;
+    int32_t status;             // 0 done, -1 failed, DISKD_UNAVAILABLE or DISKD_REFUSED not served
+};
+
+// The server does not have the image (or there is no server): do it locally
+#define DISKD_UNAVAILABLE 1
+
+// The client runs as another user than the server
+#define DISKD_REFUSED 2
+
+// Send a request to the server named by $DISKD_SOCKET and wait for it to be
+// carried out. argv[0] is the image path as given on the command line.
+// Returns 0 or -1 with the server's result, or DISKD_UNAVAILABLE.
+int diskd_call(uint8_t op, uint16_t options, uint32_t value, uint32_t depth, int argc,
+               const char *const argv[]);
+
+// Server side: a request as it arrives. Zero it before the first call to
+// diskd_receive and release it with diskd_receiver_free once done with it.
+struct diskd_receiver {
+    uint8_t *buf;
+    size_t len;
+    size_t capacity;
+    int fds[DISKD_FDS];
+    int nfds;
+};
+
+// Read whatever has arrived of a request without blocking. Returns 1 once
+// the whole request and its descriptors are in, filling in request, args and
+// fds (args are allocated and must be freed with diskd_free_args, and the
+// descriptors closed), 0 while more is still to come, or -1 on a malformed
+// request or a closed connection.
+int diskd_receive(int conn, struct diskd_receiver *rx, struct diskd_request *request,
+                  char *args[DISKD_MAX_ARGS], int fds[DISKD_FDS]);
+void diskd_receiver_free(struct diskd_receiver *rx);
+void diskd_free_args(char *args[DISKD_MAX_ARGS], int argc);
+
+// Send the reply without blocking; a client that is not reading loses it
+int diskd_reply(int conn, int status);
+
+#endif
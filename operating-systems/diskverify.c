@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "diskimg.h"
+#include "imgverify.h"
+#include "diskproto.h"
+#include "stats.h"
+
+int main(int argc, char *argv[]) {
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int build = 0;
+    int opt;
+    static const struct option long_options[] = { STATS_LONG_OPTION, { NULL, 0, NULL, 0 } };
+
+    while ((opt = getopt_long(argc, argv, "bj:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            build = 1;
+            break;
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case STATS_OPTION:
+            if (stats_enable(optarg) < 0) {
+                workers = -1;
+            }
+            break;
+        default:
+            workers = -1;
+            break;
+        }
+    }
+
+    if (argc - optind != (build ? 1 : 3) || workers < 1) {
+        fprintf(stderr, "Usage: %s [-j workers] [--stats[=json]] <disk image> <image path> <host path>\n",
+                argv[0]);
+        fprintf(stderr, "       %s -b [-j workers] [--stats[=json]] <disk image>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // A running image server does the work if it has the image, and keeps
+    // the index it builds up to date from then on
+    int served;
+    if (build) {
+        const char *args[] = { argv[optind] };
+        served = diskd_call(DISKD_VERIFY, DISKD_VERIFY_BUILD, workers, 0, 1, args);
+    } else {
+        const char *args[] = { argv[optind], argv[optind + 1], argv[optind + 2] };
+        served = diskd_call(DISKD_VERIFY, 0, workers, 0, 3, args);
+    }
+    if (served != DISKD_UNAVAILABLE) {
+        return served < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    struct disk_image img;
+    if (image_open(&img, argv[optind], 0) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Files that differ are a failure, so nightly checks can alert on them
+    int status;
+    if (build) {
+        status = sums_build(&img, workers) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else {
+        status = verify_path(&img, argv[optind + 1], argv[optind + 2], workers) == 0 ? EXIT_SUCCESS
+                                                                                     : EXIT_FAILURE;
+    }
+
+    image_close(&img);
+    stats_report("diskverify");
+    return status;
+}
@@ -0,0 +1,387 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FATSCAN_X86 1
+#endif
+
+#include "diskimg.h"
+#include "fatscan.h"
+#include "stats.h"
+
+// Entries handed to a worker at a time (4 MB of FAT)
+#define SCAN_CHUNK (1u << 20)
+
+typedef void (*census_fn)(const uint32_t *fat, size_t n, struct fat_census *census);
+
+static void census_scalar(const uint32_t *fat, size_t n, struct fat_census *census) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t entry = ntohl(fat[i]);
+
+        if (entry == FAT_FREE) {
+            census->free_blocks++;
+        } else if (entry == FAT_RESERVED) {
+            census->reserved_blocks++;
+        } else {
+            census->allocated_blocks++;
+        }
+    }
+}
+
+#ifdef FATSCAN_X86
+// The vector kernels never byte-swap: free is zero in either byte order, and
+// reserved is compared against its big-endian form. Anything else is allocated.
+
+__attribute__((target("sse2")))
+static void census_sse2(const uint32_t *fat, size_t n, struct fat_census *census) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i reserved = _mm_set1_epi32((int)htonl(FAT_RESERVED));
+    __m128i free_acc = zero, reserved_acc = zero;
+    size_t i = 0;
+
+    // A matching lane compares as -1, so subtracting counts it
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+        free_acc = _mm_sub_epi32(free_acc, _mm_cmpeq_epi32(v, zero));
+        reserved_acc = _mm_sub_epi32(reserved_acc, _mm_cmpeq_epi32(v, reserved));
+    }
+
+    uint32_t lanes_free[4], lanes_reserved[4];
+    _mm_storeu_si128((__m128i *)lanes_free, free_acc);
+    _mm_storeu_si128((__m128i *)lanes_reserved, reserved_acc);
+
+    uint32_t free_blocks = lanes_free[0] + lanes_free[1] + lanes_free[2] + lanes_free[3];
+    uint32_t reserved_blocks = lanes_reserved[0] + lanes_reserved[1] + lanes_reserved[2] + lanes_reserved[3];
+    census->free_blocks += free_blocks;
+    census->reserved_blocks += reserved_blocks;
+    census->allocated_blocks += (uint32_t)i - free_blocks - reserved_blocks;
+
+    census_scalar(fat + i, n - i, census);
+}
+
+__attribute__((target("avx2")))
+static void census_avx2(const uint32_t *fat, size_t n, struct fat_census *census) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i reserved = _mm256_set1_epi32((int)htonl(FAT_RESERVED));
+    __m256i free_acc = zero, reserved_acc = zero;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(fat + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(fat + i + 8));
+        free_acc = _mm256_sub_epi32(free_acc, _mm256_cmpeq_epi32(a, zero));
+        free_acc = _mm256_sub_epi32(free_acc, _mm256_cmpeq_epi32(b, zero));
+        reserved_acc = _mm256_sub_epi32(reserved_acc, _mm256_cmpeq_epi32(a, reserved));
+        reserved_acc = _mm256_sub_epi32(reserved_acc, _mm256_cmpeq_epi32(b, reserved));
+    }
+
+    uint32_t lanes_free[8], lanes_reserved[8];
+    _mm256_storeu_si256((__m256i *)lanes_free, free_acc);
+    _mm256_storeu_si256((__m256i *)lanes_reserved, reserved_acc);
+
+    uint32_t free_blocks = 0, reserved_blocks = 0;
+    for (int lane = 0; lane < 8; lane++) {
+        free_blocks += lanes_free[lane];
+        reserved_blocks += lanes_reserved[lane];
+    }
+    census->free_blocks += free_blocks;
+    census->reserved_blocks += reserved_blocks;
+    census->allocated_blocks += (uint32_t)i - free_blocks - reserved_blocks;
+
+    census_scalar(fat + i, n - i, census);
+}
+
+__attribute__((target("avx512f,popcnt")))
+static void census_avx512(const uint32_t *fat, size_t n, struct fat_census *census) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i reserved = _mm512_set1_epi32((int)htonl(FAT_RESERVED));
+    uint32_t free_blocks = 0, reserved_blocks = 0;
+    size_t i = 0;
+
+    // Compares produce a 16-bit lane mask; popcount turns it into a count
+    for (; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_loadu_si512((const void *)(fat + i));
+        free_blocks += _mm_popcnt_u32(_mm512_cmpeq_epi32_mask(v, zero));
+        reserved_blocks += _mm_popcnt_u32(_mm512_cmpeq_epi32_mask(v, reserved));
+    }
+
+    census->free_blocks += free_blocks;
+    census->reserved_blocks += reserved_blocks;
+    census->allocated_blocks += (uint32_t)i - free_blocks - reserved_blocks;
+
+    census_scalar(fat + i, n - i, census);
+}
+#endif
+
+static census_fn select_kernel(void) {
+#ifdef FATSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt")) {
+        return census_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return census_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return census_sse2;
+    }
+#endif
+    return census_scalar;
+}
+
+// Function to count FAT entries by kind with the best kernel for this CPU
+void fat_census(const uint32_t *fat, size_t n, struct fat_census *census) {
+    static census_fn selected;
+    census_fn kernel = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+
+    if (!kernel) {
+        kernel = select_kernel();
+        __atomic_store_n(&selected, kernel, __ATOMIC_RELAXED);
+    }
+    kernel(fat, n, census);
+}
+
+// What one chunk contributes; chunks are merged in order afterwards because
+// a free run can straddle chunk boundaries
+struct chunk_result {
+    struct fat_census census;
+    struct fat_frag frag;
+    uint32_t free_prefix;       // free entries at the start of the chunk
+    uint32_t free_suffix;       // free entries at the end of the chunk
+};
+
+struct scan_job {
+    const uint32_t *fat;
+    uint32_t n;
+    int want_frag;
+    size_t nchunks;
+    size_t next_chunk;          // claimed atomically by the workers
+    struct chunk_result *results;
+};
+
+static void frag_chunk(const uint32_t *fat, uint32_t lo, uint32_t hi, struct chunk_result *r) {
+    uint32_t free_len = 0;
+    int prev_free = lo > 0 && fat[lo - 1] == FAT_FREE;
+
+    for (uint32_t i = lo; i < hi; i++) {
+        uint32_t entry = ntohl(fat[i]);
+
+        if (entry == FAT_FREE) {
+            if (!prev_free) {
+                r->frag.free_runs++;
+            }
+            free_len++;
+            if (free_len > r->frag.longest_free_run) {
+                r->frag.longest_free_run = free_len;
+            }
+            if (free_len == i - lo + 1) {
+                r->free_prefix = free_len;
+            }
+            prev_free = 1;
+            continue;
+        }
+
+        free_len = 0;
+        prev_free = 0;
+        if (entry == FAT_RESERVED) {
+            continue;
+        }
+
+        // An allocated block ends a run unless it links to the very next block
+        if (entry == FAT_EOF) {
+            r->frag.chains++;
+        }
+        if (entry != i + 1) {
+            r->frag.runs++;
+        }
+    }
+    r->free_suffix = free_len;
+}
+
+static void *scan_worker(void *arg) {
+    struct scan_job *job = arg;
+
+    for (;;) {
+        size_t chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= job->nchunks) {
+            break;
+        }
+
+        uint32_t lo = chunk * SCAN_CHUNK;
+        uint32_t hi = (job->n - lo < SCAN_CHUNK) ? job->n : lo + SCAN_CHUNK;
+        struct chunk_result *r = &job->results[chunk];
+
+        fat_census(job->fat + lo, hi - lo, &r->census);
+        if (job->want_frag) {
+            frag_chunk(job->fat, lo, hi, r); // same chunk, still in cache
+        }
+    }
+    return NULL;
+}
+
+// Function to scan the FAT in parallel and merge the per-chunk results
+void fat_scan(const uint32_t *fat, uint32_t n, int workers,
+              struct fat_census *census, struct fat_frag *frag) {
+    struct scan_job job = {0};
+    job.fat = fat;
+    job.n = n;
+    job.want_frag = frag != NULL;
+    stats_fat(n);
+    job.nchunks = ((size_t)n + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    job.results = calloc(job.nchunks ? job.nchunks : 1, sizeof(struct chunk_result));
+
+    if (!job.results) {
+        // Fall back to a plain census rather than failing
+        fat_census(fat, n, census);
+        return;
+    }
+
+    if (workers < 1) {
+        workers = 1;
+    }
+    if ((size_t)workers > job.nchunks) {
+        workers = job.nchunks ? job.nchunks : 1;
+    }
+
+    // The calling thread is one of the workers
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 1; threads && i < workers; i++) {
+        if (pthread_create(&threads[started], NULL, scan_worker, &job) != 0) {
+            break;
+        }
+        started++;
+    }
+    scan_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // Merge in order, joining free runs that cross chunk boundaries
+    uint32_t open_free = 0;
+    for (size_t chunk = 0; chunk < job.nchunks; chunk++) {
+        struct chunk_result *r = &job.results[chunk];
+        uint32_t len = (n - chunk * SCAN_CHUNK < SCAN_CHUNK) ? n - chunk * SCAN_CHUNK : SCAN_CHUNK;
+
+        census->free_blocks += r->census.free_blocks;
+        census->reserved_blocks += r->census.reserved_blocks;
+        census->allocated_blocks += r->census.allocated_blocks;
+
+        if (!frag) {
+            continue;
+        }
+        frag->chains += r->frag.chains;
+        frag->runs += r->frag.runs;
+        frag->free_runs += r->frag.free_runs;
+
+        uint32_t joined = open_free + r->free_prefix;
+        if (joined > frag->longest_free_run) {
+            frag->longest_free_run = joined;
+        }
+        if (r->frag.longest_free_run > frag->longest_free_run) {
+            frag->longest_free_run = r->frag.longest_free_run;
+        }
+        open_free = (r->free_prefix == len) ? open_free + len : r->free_suffix;
+    }
+
+    free(job.results);
+}
+
+static uint32_t summary_check(const struct fat_summary *summary) {
+    const uint8_t *p = (const uint8_t *)summary;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(struct fat_summary, check); i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static struct fat_summary *summary_of(const struct disk_image *img) {
+    return (struct fat_summary *)(img->map + SUMMARY_OFFSET);
+}
+
+static int summary_intact(const struct fat_summary *summary) {
+    return ntohl(summary->magic) == SUMMARY_MAGIC && ntohl(summary->generation) % 2 == 0 &&
+           ntohl(summary->check) == summary_check(summary);
+}
+
+static struct timespec summary_stamp(const struct fat_summary *summary) {
+    struct timespec stamp;
+    stamp.tv_sec = (time_t)((uint64_t)ntohl(summary->stamp_seconds_high) << 32 | ntohl(summary->stamp_seconds));
+    stamp.tv_nsec = ntohl(summary->stamp_nanoseconds);
+    return stamp;
+}
+
+// Function to count the FAT from a free map
+void fat_census_of_map(const struct disk_image *img, const struct free_map *map,
+                       struct fat_census *census) {
+    census->free_blocks = map->free_blocks + map->deferred_blocks + map->free_outside;
+    census->reserved_blocks = map->reserved_blocks;
+    census->allocated_blocks = img->fat_entries - census->free_blocks - census->reserved_blocks;
+}
+
+// Function to read the census from the superblock summary
+int fat_summary_load(const struct disk_image *img, struct fat_census *census) {
+    const struct fat_summary *summary = summary_of(img);
+    if (!summary_intact(summary)) {
+        return -1;
+    }
+
+    // Written since it was sealed, by this tool or any other
+    struct stat st;
+    struct timespec stamp = summary_stamp(summary);
+    if (fstat(img->fd, &st) < 0 || st.st_mtim.tv_sec != stamp.tv_sec || st.st_mtim.tv_nsec != stamp.tv_nsec) {
+        return -1;
+    }
+
+    uint32_t free_blocks = ntohl(summary->free_blocks);
+    uint32_t reserved_blocks = ntohl(summary->reserved_blocks);
+    uint32_t allocated_blocks = ntohl(summary->allocated_blocks);
+    if ((uint64_t)free_blocks + reserved_blocks + allocated_blocks != img->fat_entries) {
+        return -1;
+    }
+
+    census->free_blocks = free_blocks;
+    census->reserved_blocks = reserved_blocks;
+    census->allocated_blocks = allocated_blocks;
+    return 0;
+}
+
+// Function to store a census in the summary
+void fat_summary_store(struct disk_image *img, const struct fat_census *census) {
+    struct fat_summary *summary = summary_of(img);
+    uint32_t generation = ntohl(summary->magic) == SUMMARY_MAGIC ? ntohl(summary->generation) : 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    summary->magic = htonl(SUMMARY_MAGIC);
+    summary->generation = htonl((generation | 1) + 1);
+    summary->free_blocks = htonl(census->free_blocks);
+    summary->reserved_blocks = htonl(census->reserved_blocks);
+    summary->allocated_blocks = htonl(census->allocated_blocks);
+    summary->stamp_seconds_high = htonl((uint32_t)((uint64_t)now.tv_sec >> 32));
+    summary->stamp_seconds = htonl((uint32_t)now.tv_sec);
+    summary->stamp_nanoseconds = htonl((uint32_t)now.tv_nsec);
+    summary->check = htonl(summary_check(summary));
+    image_dirty_range(img, summary, sizeof(*summary));
+}
+
+// Function to bind the committed summary to the image's mtime. A file
+// system that cannot keep the stamp exactly only costs the readers a scan.
+void fat_summary_seal(struct disk_image *img) {
+    const struct fat_summary *summary = summary_of(img);
+    if (!summary_intact(summary)) {
+        return;
+    }
+
+    struct timespec times[2] = { { 0, UTIME_OMIT }, summary_stamp(summary) };
+    futimens(img->fd, times);
+}
@@ -0,0 +1,79 @@
+#ifndef FATSCAN_H
+#define FATSCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "diskimg.h"
+#include "freemap.h"
+
+// How many FAT entries are free, reserved and allocated
+struct fat_census {
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;
+    uint32_t allocated_blocks;
+};
+
+// Fragmentation of the FAT, computed from the entries alone
+struct fat_frag {
+    uint32_t chains;            // chains, counted by their FAT_EOF entries
+    uint32_t runs;              // runs of blocks linked to their neighbour
+    uint32_t free_runs;
+    uint32_t longest_free_run;
+};
+
+// Add the counts for n big-endian FAT entries to census. Uses the widest
+// vector unit the CPU has (AVX-512, AVX2 or SSE2), chosen once at run time;
+// every kernel gives exactly the same counts as the scalar loop.
+void fat_census(const uint32_t *fat, size_t n, struct fat_census *census);
+
+// Scan a whole FAT of n entries, split into chunks shared out among up to
+// workers threads. census is always filled in; frag as well if it is not NULL.
+void fat_scan(const uint32_t *fat, uint32_t n, int workers,
+              struct fat_census *census, struct fat_frag *frag);
+
+// Fill census from the free map of an image; the map keeps the free count
+// current as blocks are taken and released, so nothing is scanned
+void fat_census_of_map(const struct disk_image *img, const struct free_map *map,
+                       struct fat_census *census);
+
+// Optional summary of the census, kept in the unused superblock bytes past
+// offset 30 so the counts can be read without scanning the FAT. All fields
+// are big-endian. The summary is committed in the same journal transaction
+// as the FAT it counts; an odd generation marks an update that never
+// finished. check is FNV-1a over the fields before it.
+//
+// The summary is only trusted while the image's mtime is the stamp it
+// carries, which is set once the commit holding the summary is durable.
+// Any later write to the image, by a tool that knows nothing of the summary
+// as much as by one that does, moves the mtime on and so sends the readers
+// back to scanning the FAT.
+#define SUMMARY_OFFSET 32
+#define SUMMARY_MAGIC  0x46535532  // "FSU2"
+
+struct __attribute__((packed)) fat_summary {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;
+    uint32_t allocated_blocks;
+    uint32_t stamp_seconds_high;
+    uint32_t stamp_seconds;
+    uint32_t stamp_nanoseconds;
+    uint32_t check;
+};
+
+// Fill census from the summary; returns -1 when there is no summary, an
+// update was interrupted, the image was written since it was sealed, or the
+// counts do not add up to the FAT's size
+int fat_summary_load(const struct disk_image *img, struct fat_census *census);
+
+// Store census in the summary under the next generation, stamped with the
+// current time. Commit it, then seal it with fat_summary_seal.
+void fat_summary_store(struct disk_image *img, const struct fat_census *census);
+
+// Once the commit holding the summary is durable, set the image's mtime to
+// the summary's stamp so readers can trust it
+void fat_summary_seal(struct disk_image *img);
+
+#endif
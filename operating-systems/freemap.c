@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "freemap.h"
+#include "stats.h"
+
+static int run_reserve(struct free_map *map, size_t needed) {
+    if (needed <= map->capacity) {
+        return 0;
+    }
+
+    size_t capacity = map->capacity ? map->capacity * 2 : 64;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    struct extent *runs = realloc(map->runs, capacity * sizeof(struct extent));
+    if (!runs) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    map->runs = runs;
+    map->capacity = capacity;
+    return 0;
+}
+
+static void bitmap_set(struct free_map *map, uint32_t start, uint32_t count, int is_free) {
+    for (uint32_t block = start; block < start + count; block++) {
+        if (is_free) {
+            map->bitmap[block / 64] |= (uint64_t)1 << (block % 64);
+        } else {
+            map->bitmap[block / 64] &= ~((uint64_t)1 << (block % 64));
+        }
+    }
+}
+
+// Function to build the free map from the FAT
+int freemap_build(struct free_map *map, const struct disk_image *img) {
+    memset(map, 0, sizeof(*map));
+
+    // Only blocks that have a FAT entry and exist in the image can be handed out
+    uint64_t nblocks = img->fat_entries;
+    if (nblocks > img->sb.block_count) {
+        nblocks = img->sb.block_count;
+    }
+    if (nblocks > img->size / img->sb.block_size) {
+        nblocks = img->size / img->sb.block_size;
+    }
+    map->nblocks = (uint32_t)nblocks;
+
+    map->bitmap = calloc((map->nblocks + 63) / 64 + 1, sizeof(uint64_t));
+    if (!map->bitmap) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    enum stats_phase phase = stats_enter(PHASE_FAT);
+    stats_fat(map->nblocks);
+
+    for (uint32_t i = 0; i < map->nblocks; i++) {
+        uint32_t value = fat_get(img, i);
+        if (value != FAT_FREE) {
+            map->reserved_blocks += value == FAT_RESERVED;
+            continue;
+        }
+
+        map->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+        map->free_blocks++;
+
+        // Extend the current run or start a new one
+        if (map->count > 0 && map->runs[map->count - 1].start + map->runs[map->count - 1].count == i) {
+            map->runs[map->count - 1].count++;
+        } else {
+            if (run_reserve(map, map->count + 1) < 0) {
+                freemap_free(map);
+                stats_enter(phase);
+                return -1;
+            }
+            map->runs[map->count].start = i;
+            map->runs[map->count].count = 1;
+            map->count++;
+        }
+    }
+
+    // Entries with no block behind them only add to the counts
+    for (uint32_t i = map->nblocks; i < img->fat_entries; i++) {
+        uint32_t value = fat_get(img, i);
+        map->reserved_blocks += value == FAT_RESERVED;
+        map->free_outside += value == FAT_FREE;
+    }
+    stats_fat(img->fat_entries - map->nblocks);
+    stats_enter(phase);
+    return 0;
+}
+
+void freemap_free(struct free_map *map) {
+    free(map->bitmap);
+    free(map->runs);
+    extent_list_free(&map->deferred);
+    memset(map, 0, sizeof(*map));
+}
+
+// Index of the first run starting at or after block
+static size_t run_index(const struct free_map *map, uint32_t block) {
+    size_t lo = 0, hi = map->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (map->runs[mid].start < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Take count blocks off the front of run idx
+static void run_take(struct free_map *map, size_t idx, uint32_t count) {
+    struct extent *run = &map->runs[idx];
+
+    bitmap_set(map, run->start, count, 0);
+    map->free_blocks -= count;
+    run->start += count;
+    run->count -= count;
+
+    if (run->count == 0) {
+        memmove(run, run + 1, (map->count - idx - 1) * sizeof(struct extent));
+        map->count--;
+    }
+}
+
+static int by_size_desc(const void *a, const void *b) {
+    const struct extent *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int by_start(const void *a, const void *b) {
+    const struct extent *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Index of the smallest run holding at least count blocks, or map->count
+static size_t best_fit(const struct free_map *map, uint32_t count) {
+    size_t best = map->count;
+    for (size_t i = 0; i < map->count; i++) {
+        if (map->runs[i].count >= count &&
+            (best == map->count || map->runs[i].count < map->runs[best].count)) {
+            best = i;
+            if (map->runs[i].count == count) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+// Function to allocate count blocks as one run, or fail
+int freemap_alloc_run(struct free_map *map, uint32_t count, uint32_t *start) {
+    size_t best = count ? best_fit(map, count) : map->count;
+    if (best == map->count) {
+        return -1;
+    }
+
+    *start = map->runs[best].start;
+    run_take(map, best, count);
+    return 0;
+}
+
+// Function to allocate blocks, contiguous where possible
+int freemap_alloc(struct free_map *map, uint32_t blocks_needed, struct extent_list *out) {
+    if (blocks_needed == 0) {
+        return 0;
+    }
+    if (blocks_needed > map->free_blocks) {
+        return -1;
+    }
+
+    // Best fit: the smallest single run that holds the whole request
+    uint32_t start;
+    if (freemap_alloc_run(map, blocks_needed, &start) == 0) {
+        return extent_list_add(out, start, blocks_needed);
+    }
+
+    // No single run is big enough: the largest runs give the fewest fragments
+    struct extent *by_size = malloc(map->count * sizeof(struct extent));
+    if (!by_size) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    memcpy(by_size, map->runs, map->count * sizeof(struct extent));
+    qsort(by_size, map->count, sizeof(struct extent), by_size_desc);
+
+    size_t k = 0;
+    uint32_t covered = 0;
+    while (covered + by_size[k].count < blocks_needed) {
+        covered += by_size[k].count;
+        k++;
+    }
+
+    // The last fragment only needs the remainder, so best-fit it among the
+    // runs that were not already taken whole
+    uint32_t remainder = blocks_needed - covered;
+    size_t last = k;
+    for (size_t i = k + 1; i < map->count && by_size[i].count >= remainder; i++) {
+        last = i;
+    }
+    by_size[k] = by_size[last];
+    by_size[k].count = remainder;
+
+    // Lay the fragments out in disk order so the chain only moves forward
+    qsort(by_size, k + 1, sizeof(struct extent), by_start);
+    for (size_t i = 0; i <= k; i++) {
+        run_take(map, run_index(map, by_size[i].start), by_size[i].count);
+        if (extent_list_add(out, by_size[i].start, by_size[i].count) < 0) {
+            free(by_size);
+            return -1;
+        }
+    }
+
+    free(by_size);
+    return 0;
+}
+
+// Function to take one particular block, splitting its run if needed
+int freemap_take(struct free_map *map, uint32_t block) {
+    if (!freemap_is_free(map, block)) {
+        return -1;
+    }
+
+    // The run holding block is the last one starting at or before it
+    size_t idx = run_index(map, block + 1) - 1;
+    struct extent *run = &map->runs[idx];
+
+    if (block == run->start) {
+        run_take(map, idx, 1);
+        return 0;
+    }
+
+    // Splitting the run needs a slot for its tail, so make room before
+    // changing anything
+    uint32_t tail_start = block + 1;
+    uint32_t tail_count = run->start + run->count - tail_start;
+    if (tail_count > 0 && run_reserve(map, map->count + 1) < 0) {
+        return -1;
+    }
+    run = &map->runs[idx];
+    run->count = block - run->start;
+    bitmap_set(map, block, 1, 0);
+    map->free_blocks--;
+
+    if (tail_count > 0) {
+        memmove(run + 2, run + 1, (map->count - idx - 1) * sizeof(struct extent));
+        run[1].start = tail_start;
+        run[1].count = tail_count;
+        map->count++;
+    }
+    return 0;
+}
+
+// Function to give blocks back, merging with neighbouring runs
+void freemap_release(struct free_map *map, uint32_t start, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    size_t idx = run_index(map, start);
+    int merge_prev = idx > 0 && map->runs[idx - 1].start + map->runs[idx - 1].count == start;
+    int merge_next = idx < map->count && start + count == map->runs[idx].start;
+
+    // A run of its own needs a slot; without one the blocks stay taken, which
+    // is safe, rather than free in the bitmap but missing from the runs
+    if (!merge_prev && !merge_next && run_reserve(map, map->count + 1) < 0) {
+        return;
+    }
+    bitmap_set(map, start, count, 1);
+    map->free_blocks += count;
+
+    if (merge_prev && merge_next) {
+        map->runs[idx - 1].count += count + map->runs[idx].count;
+        memmove(&map->runs[idx], &map->runs[idx + 1], (map->count - idx - 1) * sizeof(struct extent));
+        map->count--;
+    } else if (merge_prev) {
+        map->runs[idx - 1].count += count;
+    } else if (merge_next) {
+        map->runs[idx].start = start;
+        map->runs[idx].count += count;
+    } else {
+        memmove(&map->runs[idx + 1], &map->runs[idx], (map->count - idx) * sizeof(struct extent));
+        map->runs[idx].start = start;
+        map->runs[idx].count = count;
+        map->count++;
+    }
+}
+
+int freemap_defer(struct free_map *map, const struct extent_list *list) {
+    // Room for every run up front, so the runs are deferred all or none
+    size_t needed = map->deferred.count + list->count;
+    if (needed > map->deferred.capacity) {
+        struct extent *runs = realloc(map->deferred.runs, needed * sizeof(struct extent));
+        if (!runs) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        map->deferred.runs = runs;
+        map->deferred.capacity = needed;
+    }
+
+    for (size_t i = 0; i < list->count; i++) {
+        extent_list_add(&map->deferred, list->runs[i].start, list->runs[i].count);
+        map->deferred_blocks += list->runs[i].count;
+    }
+    return 0;
+}
+
+void freemap_settle(struct free_map *map) {
+    for (size_t i = 0; i < map->deferred.count; i++) {
+        freemap_release(map, map->deferred.runs[i].start, map->deferred.runs[i].count);
+    }
+    map->deferred.count = 0;
+    map->deferred_blocks = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "diskimg.h"
+
+// The free space of an image, built once from the FAT. The bitmap answers
+// "is this block free" in O(1); the runs list keeps the same information as
+// maximal free extents sorted by start block, which is what allocation uses.
+struct free_map {
+    uint64_t *bitmap;       // bit set when the block is free
+    uint32_t nblocks;       // number of blocks the map covers
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;   // reserved FAT entries, which allocation never changes
+    uint32_t free_outside;      // free FAT entries past the blocks the map covers
+    struct extent *runs;
+    size_t count;
+    size_t capacity;
+    struct extent_list deferred; // freed in the FAT, but not yet committed
+    uint32_t deferred_blocks;
+};
+
+// Build the map from the image's FAT; returns -1 on allocation failure
+int freemap_build(struct free_map *map, const struct disk_image *img);
+void freemap_free(struct free_map *map);
+
+// Take blocks_needed blocks out of the map. Uses the smallest single run
+// that fits; otherwise the fewest runs that cover the request. The chosen
+// extents are appended to out in disk order. Returns -1 if there is not
+// enough free space, leaving the map unchanged. The FAT is not touched.
+int freemap_alloc(struct free_map *map, uint32_t blocks_needed, struct extent_list *out);
+
+// Take count blocks as a single run, from the smallest free run that holds
+// them so the larger runs stay whole. Returns -1 if no run is big enough.
+int freemap_alloc_run(struct free_map *map, uint32_t count, uint32_t *start);
+
+// Take the specific block out of the map; returns -1 if it is not free
+int freemap_take(struct free_map *map, uint32_t block);
+
+// Return blocks [start, start + count) to the map
+void freemap_release(struct free_map *map, uint32_t start, uint32_t count);
+
+// Hold blocks just freed in the FAT back until freemap_settle: the image on
+// disk still uses them until the change that freed them is committed. They
+// count as free but are not handed out. Returns -1 on allocation failure,
+// deferring none of them.
+int freemap_defer(struct free_map *map, const struct extent_list *list);
+
+// Once the commit is durable, return the deferred blocks to the map
+void freemap_settle(struct free_map *map);
+
+static inline int freemap_is_free(const struct free_map *map, uint32_t block) {
+    return block < map->nblocks && (map->bitmap[block / 64] >> (block % 64)) & 1;
+}
+
+#endif
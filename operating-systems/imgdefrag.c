@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "imgdefrag.h"
+#include "fatscan.h"
+#include "journal.h"
+#include "stats.h"
+
+// Largest amount of file data moved per write
+#define COPY_CHUNK (1 << 20)
+
+// A fragmented file, found by its entry's offset in the image; pointers into
+// the mapping stay valid, but an offset is half the size
+struct defrag_candidate {
+    size_t entry_offset;
+    uint32_t runs;
+    uint32_t blocks;
+};
+
+// What one walk of the tree found
+struct defrag_scan {
+    uint64_t *seen;             // per block: part of a directory or file already walked
+    struct defrag_candidate *heap;  // the most fragmented files, least fragmented on top
+    size_t count;
+    size_t capacity;
+    uint32_t fragmented;        // fragmented files, whether or not they fit in the heap
+    uint32_t damaged;           // files whose chain disagrees with their entry
+    int cross_linked;           // some block belongs to two chains
+};
+
+// Candidates are ordered by runs, then by size, smaller files first since
+// they are more likely to find room
+static int more_fragmented(const struct defrag_candidate *a, const struct defrag_candidate *b) {
+    if (a->runs != b->runs) {
+        return a->runs > b->runs;
+    }
+    return a->blocks < b->blocks;
+}
+
+static void heap_sift_down(struct defrag_candidate *heap, size_t count, size_t i) {
+    for (;;) {
+        size_t least = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < count; child++) {
+            if (more_fragmented(&heap[least], &heap[child])) {
+                least = child;
+            }
+        }
+        if (least == i) {
+            return;
+        }
+        struct defrag_candidate swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+// Keep candidate if it is among the capacity most fragmented files so far
+static void heap_offer(struct defrag_scan *scan, const struct defrag_candidate *candidate) {
+    if (scan->count < scan->capacity) {
+        size_t i = scan->count++;
+        scan->heap[i] = *candidate;
+        while (i > 0 && more_fragmented(&scan->heap[(i - 1) / 2], &scan->heap[i])) {
+            struct defrag_candidate swap = scan->heap[i];
+            scan->heap[i] = scan->heap[(i - 1) / 2];
+            scan->heap[(i - 1) / 2] = swap;
+            i = (i - 1) / 2;
+        }
+    } else if (scan->capacity > 0 && more_fragmented(candidate, &scan->heap[0])) {
+        scan->heap[0] = *candidate;
+        heap_sift_down(scan->heap, scan->count, 0);
+    }
+}
+
+static int by_fragmentation(const void *a, const void *b) {
+    const struct defrag_candidate *x = a, *y = b;
+    return more_fragmented(x, y) ? -1 : more_fragmented(y, x);
+}
+
+// Mark the blocks of list as seen; returns -1 if one already was
+static int mark_seen(struct defrag_scan *scan, const struct extent_list *list) {
+    int status = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        for (uint32_t block = list->runs[i].start; block < list->runs[i].start + list->runs[i].count; block++) {
+            if (scan->seen[block / 64] >> (block % 64) & 1) {
+                status = -1;
+            }
+            scan->seen[block / 64] |= (uint64_t)1 << (block % 64);
+        }
+    }
+    return status;
+}
+
+// Resolve a file's chain, checking it holds exactly the blocks its entry
+// claims and ends there
+static int file_extents(const struct disk_image *img, const struct dir_entry_t *entry,
+                        struct extent_list *list) {
+    uint32_t blocks = entry_block_count(entry);
+
+    list->count = 0;
+    if (chain_extents(img, entry_start_block(entry), blocks, list) < 0) {
+        return -1;
+    }
+
+    uint32_t found = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        found += list->runs[i].count;
+    }
+    if (found != blocks) {
+        return -1;
+    }
+    uint32_t last = list->runs[list->count - 1].start + list->runs[list->count - 1].count - 1;
+    return fat_get(img, last) == FAT_EOF ? 0 : -1;
+}
+
+// Function to walk a directory subtree, noting every fragmented file
+static int scan_tree(const struct disk_image *img, uint32_t start_block, uint32_t block_count,
+                     struct defrag_scan *scan, struct extent_list *list) {
+    if (!image_contains(img, start_block, block_count) || start_block >= img->fat_entries) {
+        fprintf(stderr, "Error: Directory lies outside the disk image.\n");
+        return -1;
+    }
+
+    // A directory reachable twice means the image has a cycle; walk it once
+    if (scan->seen[start_block / 64] >> (start_block % 64) & 1) {
+        return 0;
+    }
+
+    // The root's blocks are fixed by the superblock rather than chained
+    list->count = 0;
+    int listed = start_block == img->sb.root_start ? extent_list_add(list, start_block, block_count)
+                                                   : chain_extents(img, start_block, block_count, list);
+    if (listed < 0) {
+        return -1;
+    }
+    if (mark_seen(scan, list) < 0) {
+        scan->cross_linked = 1;
+    }
+
+    struct dir_iter it;
+    const struct dir_entry_t *entry;
+    int status = 0;
+
+    dir_iter_init(&it, img, start_block, block_count);
+    while ((entry = dir_iter_next(&it))) {
+        if (!entry_in_use(entry) || entry_name_eq(entry, ".") || entry_name_eq(entry, "..")) {
+            continue;
+        }
+
+        if (entry_is_dir(entry)) {
+            if (scan_tree(img, entry_start_block(entry), entry_block_count(entry), scan, list) < 0) {
+                status = -1;
+            }
+            continue;
+        }
+
+        if (entry_block_count(entry) == 0) {
+            continue;
+        }
+        if (file_extents(img, entry, list) < 0) {
+            scan->damaged++;
+            continue;
+        }
+        if (mark_seen(scan, list) < 0) {
+            scan->cross_linked = 1;
+        }
+
+        if (list->count > 1) {
+            struct defrag_candidate candidate = {
+                .entry_offset = (const uint8_t *)entry - img->map,
+                .runs = (uint32_t)list->count,
+                .blocks = entry_block_count(entry),
+            };
+            scan->fragmented++;
+            heap_offer(scan, &candidate);
+        }
+    }
+    return status;
+}
+
+// Function to find the most fragmented files, up to capacity of them
+static int scan_image(const struct disk_image *img, struct defrag_scan *scan, size_t capacity) {
+    size_t nblocks = img->size / img->sb.block_size;
+
+    memset(scan, 0, sizeof(*scan));
+    scan->seen = calloc(nblocks / 64 + 1, sizeof(uint64_t));
+    scan->heap = capacity ? malloc(capacity * sizeof(struct defrag_candidate)) : NULL;
+    if (!scan->seen || (capacity && !scan->heap)) {
+        perror("Memory allocation failed");
+        free(scan->seen);
+        free(scan->heap);
+        scan->heap = NULL;
+        return -1;
+    }
+    scan->capacity = capacity;
+
+    struct extent_list list = {0};
+    enum stats_phase phase = stats_enter(PHASE_RESOLVE);
+    int status = scan_tree(img, img->sb.root_start, img->sb.root_blocks, scan, &list);
+    stats_enter(phase);
+    extent_list_free(&list);
+
+    free(scan->seen);
+    scan->seen = NULL;
+    qsort(scan->heap, scan->count, sizeof(struct defrag_candidate), by_fragmentation);
+    return status;
+}
+
+// Function to print the fragmentation of the image's files and free space
+static void print_fragmentation(const struct disk_image *img, int workers, uint32_t fragmented) {
+    struct fat_census census = {0};
+    struct fat_frag frag = {0};
+
+    enum stats_phase phase = stats_enter(PHASE_FAT);
+    fat_scan(img->fat, img->fat_entries, workers, &census, &frag);
+    stats_enter(phase);
+
+    printf("Fragmented files: %u\n", fragmented);
+    printf("Chains: %u\n", frag.chains);
+    printf("Runs: %u\n", frag.runs);
+    printf("Average run length: %.2f\n", frag.runs ? (double)census.allocated_blocks / frag.runs : 0.0);
+    printf("Free runs: %u\n", frag.free_runs);
+    printf("Longest free run: %u\n", frag.longest_free_run);
+}
+
+// Function to make the moves so far durable, then hand the blocks they
+// vacated back to the free map. Until the commit the old chains are still
+// what the image on disk points to, so their blocks must not be reused.
+static int commit_moves(struct disk_image *img, struct free_map *map, struct extent_list *vacated) {
+    if (vacated->count == 0) {
+        return 0;
+    }
+
+    // The vacated blocks are free in the FAT already, though not yet in the map
+    struct fat_census census;
+    fat_census_of_map(img, map, &census);
+    for (size_t i = 0; i < vacated->count; i++) {
+        census.free_blocks += vacated->runs[i].count;
+        census.allocated_blocks -= vacated->runs[i].count;
+    }
+    fat_summary_store(img, &census);
+
+    enum stats_phase phase = stats_enter(PHASE_FLUSH);
+    int status = journal_commit(img);
+    stats_enter(phase);
+    if (status < 0) {
+        return -1;
+    }
+    fat_summary_seal(img);
+
+    for (size_t i = 0; i < vacated->count; i++) {
+        freemap_release(map, vacated->runs[i].start, vacated->runs[i].count);
+    }
+    vacated->count = 0;
+    return 0;
+}
+
+// Function to copy a file into the run at start and point its entry there
+static int move_file(struct disk_image *img, struct dir_entry_t *entry, const struct extent_list *old,
+                     uint32_t start, struct extent_list *vacated) {
+    uint32_t block_size = img->sb.block_size;
+    uint32_t chunk_blocks = COPY_CHUNK / block_size ? COPY_CHUNK / block_size : 1;
+    uint32_t target = start;
+
+    // The data is copied straight out of the mapping, one run at a time
+    enum stats_phase phase = stats_enter(PHASE_COPY);
+    for (size_t i = 0; i < old->count; i++) {
+        for (uint32_t done = 0; done < old->runs[i].count; done += chunk_blocks) {
+            uint32_t blocks = old->runs[i].count - done;
+            if (blocks > chunk_blocks) {
+                blocks = chunk_blocks;
+            }
+            const uint8_t *data = image_block(img, old->runs[i].start + done);
+            stats_access((off_t)(data - img->map), (size_t)blocks * block_size);
+            stats_read((size_t)blocks * block_size);
+            if (image_write(img, target, data, (size_t)blocks * block_size) < 0) {
+                stats_enter(phase);
+                return -1;
+            }
+            target += blocks;
+        }
+    }
+    stats_enter(phase);
+
+    // New chain first, then the entry, then the old blocks; all of it
+    // reaches the image together in the next commit
+    struct extent run = { start, target - start };
+    struct extent_list moved = { &run, 1, 1 };
+    chain_link(img, &moved);
+
+    entry->starting_block = htonl(start);
+    image_dirty_range(img, entry, sizeof(*entry));
+
+    for (size_t i = 0; i < old->count; i++) {
+        for (uint32_t block = old->runs[i].start; block < old->runs[i].start + old->runs[i].count; block++) {
+            fat_set(img, block, FAT_FREE);
+        }
+        if (extent_list_add(vacated, old->runs[i].start, old->runs[i].count) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to defragment the files of an image, in passes of at most
+// DEFRAG_BATCH files
+int defrag_image(struct disk_image *img, struct free_map *map, int workers, int dry_run) {
+    struct defrag_scan scan;
+    if (scan_image(img, &scan, dry_run ? 0 : DEFRAG_BATCH) < 0) {
+        free(scan.heap);
+        return -1;
+    }
+    if (scan.cross_linked) {
+        fprintf(stderr, "Error: Some blocks belong to more than one chain; repair the image first.\n");
+        free(scan.heap);
+        return -1;
+    }
+    if (scan.damaged > 0) {
+        fprintf(stderr, "Warning: %u files have chains that disagree with their entries; they are left alone.\n",
+                scan.damaged);
+    }
+
+    printf(dry_run ? "Fragmentation information:\n" : "Before defragmentation:\n");
+    print_fragmentation(img, workers, scan.fragmented);
+    if (dry_run) {
+        return 0;
+    }
+
+    uint32_t total_fragmented = scan.fragmented;
+    uint32_t moved_files = 0, no_room = 0;
+    uint64_t moved_blocks = 0;
+    struct extent_list old = {0}, vacated = {0};
+    int status = 0;
+
+    while (status == 0 && scan.count > 0) {
+        uint32_t moved_this_pass = 0;
+        no_room = 0;
+
+        for (size_t i = 0; i < scan.count && status == 0; i++) {
+            struct dir_entry_t *entry = (struct dir_entry_t *)(img->map + scan.heap[i].entry_offset);
+            if (file_extents(img, entry, &old) < 0) {
+                continue;
+            }
+
+            // Blocks vacated earlier in the pass become usable once committed
+            uint32_t start;
+            if (freemap_alloc_run(map, scan.heap[i].blocks, &start) < 0) {
+                if (vacated.count == 0 || commit_moves(img, map, &vacated) < 0 ||
+                    freemap_alloc_run(map, scan.heap[i].blocks, &start) < 0) {
+                    no_room++;
+                    continue;
+                }
+            }
+
+            if (move_file(img, entry, &old, start, &vacated) < 0) {
+                status = -1;
+                break;
+            }
+            moved_this_pass++;
+            moved_blocks += scan.heap[i].blocks;
+        }
+
+        if (commit_moves(img, map, &vacated) < 0) {
+            status = -1;
+        }
+        moved_files += moved_this_pass;
+
+        // Another pass only if this one was full and got somewhere
+        int more = status == 0 && moved_this_pass > 0 && scan.fragmented > scan.count;
+        free(scan.heap);
+        scan.heap = NULL;
+        scan.count = 0;
+        if (more && scan_image(img, &scan, DEFRAG_BATCH) < 0) {
+            status = -1;
+        }
+    }
+    free(scan.heap);
+    extent_list_free(&old);
+    extent_list_free(&vacated);
+
+    printf("\nMoved %u of %u fragmented files (%llu blocks).\n", moved_files, total_fragmented,
+           (unsigned long long)moved_blocks);
+    if (no_room > 0) {
+        printf("%u files are larger than any free run and were left in place.\n", no_room);
+    }
+
+    if (scan_image(img, &scan, 0) < 0) {
+        return -1;
+    }
+    printf("\nAfter defragmentation:\n");
+    print_fragmentation(img, workers, scan.fragmented);
+    return status;
+}
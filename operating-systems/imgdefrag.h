@@ -0,0 +1,18 @@
+#ifndef IMGDEFRAG_H
+#define IMGDEFRAG_H
+
+#include "diskimg.h"
+#include "freemap.h"
+
+// Most fragmented files held in memory per pass; the rest wait for a later one
+#define DEFRAG_BATCH 4096
+
+// Rewrite fragmented files into single contiguous runs, most fragmented first,
+// printing the fragmentation before and after to stdout. Each file goes to
+// the smallest free run that holds it whole; files no run can hold are left
+// alone, and directories are never moved. Every pass is committed through
+// the journal before the blocks it vacated are reused, so an interrupted
+// defragmentation loses nothing. With dry_run only the report is printed.
+int defrag_image(struct disk_image *img, struct free_map *map, int workers, int dry_run);
+
+#endif
@@ -0,0 +1,741 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "imgfsck.h"
+#include "fatscan.h"
+#include "journal.h"
+#include "stats.h"
+
+// Owners in the ownership map: 0 for nobody, OWNER_SYSTEM for the superblock
+// and FAT, and node i as OWNER_FIRST + i. The lower owner keeps a shared
+// block, so the outcome does not depend on which thread got there first.
+#define OWNER_SYSTEM 1
+#define OWNER_FIRST  2
+
+// Blocks of the lost-chain scan handed to a worker at a time
+#define SCAN_CHUNK 65536
+
+// Longest path reported
+#define FSCK_PATH_MAX 4096
+
+// How a chain walk stopped
+enum chain_end {
+    END_EOF,        // at a FAT_EOF entry, as it should
+    END_SHARED,     // at a block a lower chain owns
+    END_LOOP,       // at a block of its own
+    END_OUTSIDE,    // at an entry pointing outside the image
+    END_FREE,       // at a block whose own entry is free or reserved
+    END_LONG        // after as many blocks as the entry accounts for, still linked on
+};
+
+// Problems found with an entry
+#define PROBLEM_SHARED   0x01
+#define PROBLEM_LOOP     0x02
+#define PROBLEM_OUTSIDE  0x04
+#define PROBLEM_FREE     0x08
+#define PROBLEM_UNLINKED 0x10
+#define PROBLEM_COUNT    0x20
+#define PROBLEM_SIZE     0x40
+#define PROBLEM_LONG     0x80
+#define PROBLEM_NAME     0x100
+
+// A file or directory reached from the root
+struct fsck_node {
+    struct dir_entry_t *entry;  // NULL for the root
+    uint32_t parent;            // index of the directory holding it
+    uint32_t start_block;       // FAT_EOF when there is no chain to follow
+    uint32_t block_count;
+    uint32_t limit;             // most blocks the entry can account for
+    uint32_t chain_blocks;      // blocks claimed on the first walk
+    uint32_t good_blocks;       // leading blocks still owned once the level is done
+    uint32_t stop_block;        // where the walk stopped
+    uint32_t stop_owner;        // who owned stop_block then, when it was shared
+    uint32_t twin;              // an earlier entry of the same directory with the same name
+    uint8_t end;                // enum chain_end
+    uint8_t unlinked;           // directory blocks the FAT does not link
+    uint8_t duplicate;          // twin is set: lookups by name find the twin instead
+};
+
+// An entry of one directory, sorted by name to find names used twice
+struct sibling {
+    const char *name;
+    int len;
+    uint32_t index;
+};
+
+struct fsck {
+    struct disk_image *img;
+    uint32_t nblocks;           // blocks with both a FAT entry and data
+    uint32_t system_blocks;     // the superblock and FAT, owned by OWNER_SYSTEM
+    uint32_t *owner;
+    uint64_t *pointed;          // per block: some lost block's entry points here
+    struct fsck_node *nodes;    // in breadth-first order, the root first
+    size_t count;
+    size_t capacity;
+    size_t level_start;         // first node of the level being walked
+    uint32_t lost_blocks;
+    uint32_t lost_chains;
+};
+
+// jobs calls of job, shared out among worker threads
+struct fsck_pool {
+    struct fsck *fsck;
+    void (*job)(struct fsck *, size_t);
+    size_t jobs;
+    size_t next;
+};
+
+static void *pool_worker(void *arg) {
+    struct fsck_pool *pool = arg;
+
+    for (;;) {
+        size_t job = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (job >= pool->jobs) {
+            break;
+        }
+        pool->job(pool->fsck, job);
+    }
+    return NULL;
+}
+
+// Function to run jobs on up to workers threads, the calling thread included
+static void run_pool(struct fsck *fsck, int workers, size_t jobs, void (*job)(struct fsck *, size_t)) {
+    struct fsck_pool pool = { fsck, job, jobs, 0 };
+
+    if ((size_t)workers > jobs) {
+        workers = jobs ? (int)jobs : 1;
+    }
+    pthread_t *threads = workers > 1 ? calloc(workers - 1, sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (threads && started < workers - 1 && pthread_create(&threads[started], NULL, pool_worker, &pool) == 0) {
+        started++;
+    }
+
+    pool_worker(&pool);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Function to find the block after block, the walked-th block of node's
+// chain. Returns FAT_EOF where the chain ends, with *end saying why.
+static uint32_t chain_step(const struct fsck *fsck, const struct fsck_node *node, uint32_t block,
+                           uint32_t walked, enum chain_end *end, uint8_t *unlinked) {
+    uint32_t next = fat_get(fsck->img, block);
+    *end = END_EOF;
+
+    // Directories are read for block_count blocks, taking blocks the FAT does
+    // not link as contiguous (see dir_next_block); the root is contiguous
+    // whatever the FAT says
+    if (!node->entry || entry_is_dir(node->entry)) {
+        uint32_t expected = walked < node->block_count ? block + 1 : FAT_EOF;
+        if (!node->entry ? next != expected : next == FAT_FREE || next == FAT_RESERVED) {
+            if (unlinked) {
+                *unlinked = 1;
+            }
+            next = expected;
+        }
+    }
+
+    if (next == FAT_EOF) {
+        return FAT_EOF;
+    }
+    if (next == FAT_FREE || next == FAT_RESERVED) {
+        *end = END_FREE;
+        return FAT_EOF;
+    }
+    if (next >= fsck->nblocks) {
+        *end = END_OUTSIDE;
+        return FAT_EOF;
+    }
+    return next;
+}
+
+// Function to follow a chain of the current level, claiming each block
+static void claim_chain(struct fsck *fsck, size_t job) {
+    size_t index = fsck->level_start + job;
+    struct fsck_node *node = &fsck->nodes[index];
+    uint32_t me = OWNER_FIRST + (uint32_t)index;
+    uint32_t block = node->start_block;
+    uint32_t walked = 0;
+    enum chain_end end = node->end;
+
+    while (block != FAT_EOF) {
+        uint32_t current = __atomic_load_n(&fsck->owner[block], __ATOMIC_RELAXED);
+        int claimed = 0;
+        while (!claimed && current != me && !(current != 0 && current < me)) {
+            claimed = __atomic_compare_exchange_n(&fsck->owner[block], &current, me, 0,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        node->stop_block = block;
+        if (!claimed) {
+            end = current == me ? END_LOOP : END_SHARED;
+            node->stop_owner = current;
+            break;
+        }
+
+        walked++;
+        block = chain_step(fsck, node, block, walked, &end, &node->unlinked);
+
+        // What runs on past the entry's blocks is cut off rather than
+        // claimed, as it is more likely someone else's
+        if (block != FAT_EOF && walked == node->limit) {
+            if (__atomic_load_n(&fsck->owner[block], __ATOMIC_RELAXED) == me) {
+                end = END_LOOP;
+                node->stop_block = block;
+            } else {
+                end = END_LONG;
+            }
+            break;
+        }
+    }
+
+    stats_fat(walked);
+    node->chain_blocks = walked;
+    node->end = end;
+}
+
+// Function to count how much of a chain its node still owns, now that every
+// chain of the level has been walked and the lower owners have won
+static void settle_chain(struct fsck *fsck, size_t job) {
+    size_t index = fsck->level_start + job;
+    struct fsck_node *node = &fsck->nodes[index];
+    uint32_t me = OWNER_FIRST + (uint32_t)index;
+    uint32_t block = node->start_block;
+    uint32_t good = 0;
+    enum chain_end end;
+
+    while (good < node->chain_blocks && __atomic_load_n(&fsck->owner[block], __ATOMIC_RELAXED) == me) {
+        good++;
+        if (good < node->chain_blocks) {
+            block = chain_step(fsck, node, block, good, &end, NULL);
+        }
+    }
+
+    node->good_blocks = good;
+    if (good < node->chain_blocks) {
+        node->end = END_SHARED;
+        node->stop_block = block;
+        node->stop_owner = __atomic_load_n(&fsck->owner[block], __ATOMIC_RELAXED);
+    }
+}
+
+// Function to give up the blocks a chain claimed past the point where a lower
+// chain took one of its blocks. The lower chain may have stopped short of
+// them, so they are left to later levels or counted as lost. Run once every
+// chain of the level is settled, so the cuts do not depend on the order.
+static void release_tail(struct fsck *fsck, size_t job) {
+    size_t index = fsck->level_start + job;
+    struct fsck_node *node = &fsck->nodes[index];
+    uint32_t me = OWNER_FIRST + (uint32_t)index;
+    uint32_t block = node->stop_block;
+    enum chain_end end;
+
+    for (uint32_t walked = node->good_blocks; walked < node->chain_blocks; walked++) {
+        if (__atomic_load_n(&fsck->owner[block], __ATOMIC_RELAXED) == me) {
+            __atomic_store_n(&fsck->owner[block], 0, __ATOMIC_RELAXED);
+        }
+        if (walked + 1 < node->chain_blocks) {
+            block = chain_step(fsck, node, block, walked + 1, &end, NULL);
+        }
+    }
+}
+
+// Function to collect the first count blocks of a node's chain
+static int node_blocks(const struct fsck *fsck, const struct fsck_node *node, uint32_t count,
+                       struct extent_list *list) {
+    uint32_t block = node->start_block;
+    enum chain_end end;
+
+    list->count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (extent_list_add(list, block, 1) < 0) {
+            return -1;
+        }
+        if (i + 1 < count) {
+            block = chain_step(fsck, node, block, i + 1, &end, NULL);
+        }
+    }
+    return 0;
+}
+
+static int add_node(struct fsck *fsck, struct dir_entry_t *entry, uint32_t parent,
+                    uint32_t start_block, uint32_t block_count) {
+    if (fsck->count == fsck->capacity) {
+        size_t capacity = fsck->capacity ? fsck->capacity * 2 : 1024;
+        struct fsck_node *nodes = realloc(fsck->nodes, capacity * sizeof(struct fsck_node));
+        if (!nodes) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        fsck->nodes = nodes;
+        fsck->capacity = capacity;
+    }
+
+    struct fsck_node *node = &fsck->nodes[fsck->count++];
+    memset(node, 0, sizeof(*node));
+    node->entry = entry;
+    node->parent = parent;
+    node->start_block = start_block;
+    node->block_count = block_count;
+    node->stop_block = start_block;
+    node->end = END_EOF;
+
+    // A file accounts for the blocks of its block_count or its file_size,
+    // whichever is more, in case just one of them is wrong
+    uint32_t file_size = entry && !entry_is_dir(entry) ? entry_file_size(entry) : 0;
+    uint32_t block_size = fsck->img->sb.block_size;
+    uint32_t needed = (uint32_t)(((uint64_t)file_size + block_size - 1) / block_size);
+    node->limit = block_count > needed ? block_count : needed;
+
+    // An empty file has no chain; any other entry must start inside the image
+    if (block_count == 0 && file_size == 0) {
+        node->start_block = FAT_EOF;
+    } else if (start_block >= fsck->nblocks) {
+        node->start_block = FAT_EOF;
+        node->end = END_OUTSIDE;
+    }
+    return 0;
+}
+
+static int compare_siblings(const void *a, const void *b) {
+    const struct sibling *x = a, *y = b;
+    int len = x->len < y->len ? x->len : y->len;
+    int order = memcmp(x->name, y->name, len);
+    if (order == 0) {
+        order = x->len != y->len ? x->len - y->len : (x->index > y->index) - (x->index < y->index);
+    }
+    return order;
+}
+
+// Function to mark the entries of a directory, nodes first to fsck->count,
+// whose name an earlier entry of the directory already has
+static int mark_duplicates(struct fsck *fsck, size_t first) {
+    size_t count = fsck->count - first;
+    if (count < 2) {
+        return 0;
+    }
+
+    struct sibling *siblings = malloc(count * sizeof(struct sibling));
+    if (!siblings) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        siblings[i].name = fsck->nodes[first + i].entry->filename;
+        siblings[i].len = entry_name_len(fsck->nodes[first + i].entry);
+        siblings[i].index = (uint32_t)(first + i);
+    }
+    qsort(siblings, count, sizeof(struct sibling), compare_siblings);
+
+    // Each run of equal names is in directory order; all but its first lose
+    for (size_t i = 1; i < count; i++) {
+        if (siblings[i].len == siblings[i - 1].len &&
+            memcmp(siblings[i].name, siblings[i - 1].name, siblings[i].len) == 0) {
+            struct fsck_node *node = &fsck->nodes[siblings[i].index];
+            const struct fsck_node *prev = &fsck->nodes[siblings[i - 1].index];
+            node->duplicate = 1;
+            node->twin = prev->duplicate ? prev->twin : siblings[i - 1].index;
+        }
+    }
+    free(siblings);
+    return 0;
+}
+
+// Function to add the entries of a directory as nodes of the next level,
+// reading only the blocks its chain really owns
+static int add_children(struct fsck *fsck, size_t index, struct extent_list *list) {
+    const struct fsck_node *dir = &fsck->nodes[index];
+    size_t first = fsck->count;
+    uint32_t blocks = dir->good_blocks < dir->block_count ? dir->good_blocks : dir->block_count;
+    uint32_t per_block = fsck->img->sb.block_size / DIRECTORY_ENTRY_SIZE;
+
+    if (node_blocks(fsck, dir, blocks, list) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < list->count; i++) {
+        for (uint32_t block = list->runs[i].start; block < list->runs[i].start + list->runs[i].count; block++) {
+            struct dir_entry_t *entries = (struct dir_entry_t *)image_block(fsck->img, block);
+            for (uint32_t j = 0; j < per_block; j++) {
+                struct dir_entry_t *entry = &entries[j];
+                if (!entry_in_use(entry) || entry_name_eq(entry, ".") || entry_name_eq(entry, "..")) {
+                    continue;
+                }
+                if (add_node(fsck, entry, (uint32_t)index, entry_start_block(entry), entry_block_count(entry)) < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return mark_duplicates(fsck, first);
+}
+
+static int is_lost(const struct fsck *fsck, uint32_t block) {
+    uint32_t value = fat_get(fsck->img, block);
+    return block >= fsck->system_blocks && value != FAT_FREE && value != FAT_RESERVED &&
+           __atomic_load_n(&fsck->owner[block], __ATOMIC_RELAXED) == 0;
+}
+
+// Function to count the allocated blocks no chain reached, and mark where
+// their entries point so the heads of the lost chains can be told apart
+static void scan_lost(struct fsck *fsck, size_t job) {
+    uint32_t first = (uint32_t)(job * SCAN_CHUNK);
+    uint32_t last = fsck->nblocks - first > SCAN_CHUNK ? first + SCAN_CHUNK : fsck->nblocks;
+    uint32_t lost = 0;
+
+    for (uint32_t block = first; block < last; block++) {
+        if (!is_lost(fsck, block)) {
+            continue;
+        }
+        lost++;
+        uint32_t next = fat_get(fsck->img, block);
+        if (next < fsck->nblocks) {
+            __atomic_fetch_or(&fsck->pointed[next / 64], (uint64_t)1 << (next % 64), __ATOMIC_RELAXED);
+        }
+    }
+    stats_fat(last - first);
+    __atomic_fetch_add(&fsck->lost_blocks, lost, __ATOMIC_RELAXED);
+}
+
+static void count_lost_heads(struct fsck *fsck, size_t job) {
+    uint32_t first = (uint32_t)(job * SCAN_CHUNK);
+    uint32_t last = fsck->nblocks - first > SCAN_CHUNK ? first + SCAN_CHUNK : fsck->nblocks;
+    uint32_t heads = 0;
+
+    for (uint32_t block = first; block < last; block++) {
+        if (is_lost(fsck, block) && !(fsck->pointed[block / 64] >> (block % 64) & 1)) {
+            heads++;
+        }
+    }
+    __atomic_fetch_add(&fsck->lost_chains, heads, __ATOMIC_RELAXED);
+}
+
+// Function to build the path of a node for the report
+static void node_path(const struct fsck *fsck, size_t index, char *path, size_t size) {
+    const struct fsck_node *node = &fsck->nodes[index];
+    if (!node->entry) {
+        snprintf(path, size, "/");
+        return;
+    }
+
+    node_path(fsck, node->parent, path, size);
+    size_t len = strlen(path);
+    snprintf(path + len, size - len, "%s%.*s", len > 1 ? "/" : "", entry_name_len(node->entry),
+             node->entry->filename);
+}
+
+// Function to work out what is wrong with a node
+static int node_problems(const struct fsck *fsck, const struct fsck_node *node) {
+    static const int end_problems[] = {
+        [END_EOF] = 0, [END_SHARED] = PROBLEM_SHARED, [END_LOOP] = PROBLEM_LOOP,
+        [END_OUTSIDE] = PROBLEM_OUTSIDE, [END_FREE] = PROBLEM_FREE, [END_LONG] = PROBLEM_LONG
+    };
+    int problems = end_problems[node->end];
+
+    if (node->unlinked) {
+        problems |= PROBLEM_UNLINKED;
+    }
+    if (node->duplicate) {
+        problems |= PROBLEM_NAME;
+    }
+    // A chain cut short by another problem is reported as that problem
+    if (node->end == END_EOF && node->good_blocks != node->block_count) {
+        problems |= PROBLEM_COUNT;
+    }
+    if (node->entry && !entry_is_dir(node->entry)) {
+        uint32_t block_size = fsck->img->sb.block_size;
+        uint32_t needed = (uint32_t)(((uint64_t)entry_file_size(node->entry) + block_size - 1) / block_size);
+        if (needed != node->block_count) {
+            problems |= PROBLEM_SIZE;
+        }
+    }
+    return problems;
+}
+
+// Function to print each problem of a node; returns how many there were
+static int report_node(const struct fsck *fsck, size_t index, int problems) {
+    const struct fsck_node *node = &fsck->nodes[index];
+    char path[FSCK_PATH_MAX];
+    node_path(fsck, index, path, sizeof(path));
+
+    if (problems & PROBLEM_SHARED) {
+        uint32_t owner = node->stop_owner;
+        char other[FSCK_PATH_MAX];
+        if (owner == OWNER_SYSTEM) {
+            snprintf(other, sizeof(other), "the superblock and FAT");
+        } else {
+            node_path(fsck, owner - OWNER_FIRST, other, sizeof(other));
+        }
+        printf("%s: block %u also belongs to %s\n", path, node->stop_block, other);
+    }
+    if (problems & PROBLEM_LOOP) {
+        printf("%s: chain loops back to block %u\n", path, node->stop_block);
+    }
+    if (problems & PROBLEM_OUTSIDE) {
+        if (node->chain_blocks == 0) {
+            printf("%s: starting block %u is outside the image\n", path, node->stop_block);
+        } else {
+            printf("%s: chain points outside the image after block %u\n", path, node->stop_block);
+        }
+    }
+    if (problems & PROBLEM_FREE) {
+        printf("%s: block %u is in use but free or reserved in the FAT\n", path, node->stop_block);
+    }
+    if (problems & PROBLEM_LONG) {
+        printf("%s: chain runs on past its last block %u\n", path, node->stop_block);
+    }
+    if (problems & PROBLEM_UNLINKED) {
+        printf("%s: directory blocks are not linked in the FAT\n", path);
+    }
+    if (problems & PROBLEM_COUNT) {
+        printf("%s: block_count is %u but the chain has %u blocks\n", path, node->block_count, node->good_blocks);
+    }
+    if (problems & PROBLEM_NAME) {
+        printf("%s: the name is already taken by an earlier %s\n", path,
+               entry_is_dir(fsck->nodes[node->twin].entry) ? "directory" : "file");
+    }
+    if (problems & PROBLEM_SIZE) {
+        uint32_t block_size = fsck->img->sb.block_size;
+        uint32_t file_size = entry_file_size(node->entry);
+        printf("%s: file_size %u needs %u blocks but block_count is %u\n", path, file_size,
+               (uint32_t)(((uint64_t)file_size + block_size - 1) / block_size), node->block_count);
+    }
+    return __builtin_popcount(problems);
+}
+
+// Function to fix a node: its chain is cut back to the blocks it owns (and,
+// for a file, to what its file_size needs), relinked, and its entry made to
+// match. Blocks it owned past the cut are freed.
+static int repair_node(struct fsck *fsck, const struct fsck_node *node, struct extent_list *list) {
+    struct disk_image *img = fsck->img;
+    struct dir_entry_t *entry = node->entry;
+    uint32_t block_size = img->sb.block_size;
+    uint32_t keep = node->good_blocks;
+
+    if (entry && !entry_is_dir(entry)) {
+        uint32_t needed = (uint32_t)(((uint64_t)entry_file_size(entry) + block_size - 1) / block_size);
+        keep = keep < needed ? keep : needed;
+    } else if (entry) {
+        keep = keep < node->block_count ? keep : node->block_count;
+    }
+
+    if (node_blocks(fsck, node, node->good_blocks, list) < 0) {
+        return -1;
+    }
+
+    // Free what is cut off, from the back, then link what is kept
+    uint32_t seen = 0;
+    struct extent_list kept = {0};
+    for (size_t i = 0; i < list->count; i++) {
+        for (uint32_t block = list->runs[i].start; block < list->runs[i].start + list->runs[i].count; block++) {
+            if (seen++ < keep) {
+                if (extent_list_add(&kept, block, 1) < 0) {
+                    extent_list_free(&kept);
+                    return -1;
+                }
+            } else {
+                fat_set(img, block, FAT_FREE);
+            }
+        }
+    }
+    chain_link(img, &kept);
+    extent_list_free(&kept);
+
+    if (!entry) {
+        return 0;
+    }
+    if (entry_is_dir(entry) && keep == 0) {
+        entry->status = STATUS_FREE;
+    } else {
+        entry->starting_block = htonl(keep ? node->start_block : FAT_EOF);
+        entry->block_count = htonl(keep);
+        if (!entry_is_dir(entry) && entry_file_size(entry) > (uint64_t)keep * block_size) {
+            entry->file_size = htonl(keep * block_size);
+        }
+    }
+    image_dirty_range(img, entry, sizeof(*entry));
+    return 0;
+}
+
+// Function to give a node whose name an earlier entry took a name of its own:
+// its name with the first free ~N appended, shortened to fit
+static void rename_node(struct fsck *fsck, size_t index) {
+    struct fsck_node *node = &fsck->nodes[index];
+    char path[FSCK_PATH_MAX];
+    node_path(fsck, index, path, sizeof(path));
+
+    // The entries of a directory are neighbours among the nodes
+    size_t first = index, last = index + 1;
+    while (first > 0 && fsck->nodes[first - 1].entry && fsck->nodes[first - 1].parent == node->parent) {
+        first--;
+    }
+    while (last < fsck->count && fsck->nodes[last].parent == node->parent) {
+        last++;
+    }
+
+    char name[31];
+    for (unsigned n = 1;; n++) {
+        char suffix[16];
+        int suffix_len = snprintf(suffix, sizeof(suffix), "~%u", n);
+        int len = entry_name_len(node->entry);
+        if (len > 30 - suffix_len) {
+            len = 30 - suffix_len;
+        }
+        snprintf(name, sizeof(name), "%.*s%s", len, node->entry->filename, suffix);
+
+        size_t i = first;
+        while (i < last && (i == index || !entry_name_eq(fsck->nodes[i].entry, name))) {
+            i++;
+        }
+        if (i == last) {
+            break;
+        }
+    }
+
+    memset(node->entry->filename, 0, sizeof(node->entry->filename));
+    memcpy(node->entry->filename, name, strlen(name));
+    image_dirty_range(fsck->img, node->entry, sizeof(*node->entry));
+    printf("%s: renamed to %s\n", path, name);
+}
+
+// Function to check, and with repair fix, an image
+int fsck_image(struct disk_image *img, int workers, int repair) {
+    struct fsck fsck = {0};
+    fsck.img = img;
+
+    uint64_t nblocks = img->fat_entries;
+    if (nblocks > img->size / img->sb.block_size) {
+        nblocks = img->size / img->sb.block_size;
+    }
+    fsck.nblocks = (uint32_t)nblocks;
+    fsck.system_blocks = img->sb.fat_start + img->sb.fat_blocks < fsck.nblocks ?
+                         img->sb.fat_start + img->sb.fat_blocks : fsck.nblocks;
+
+    fsck.owner = calloc(fsck.nblocks + 1, sizeof(uint32_t));
+    fsck.pointed = calloc(fsck.nblocks / 64 + 1, sizeof(uint64_t));
+    if (!fsck.owner || !fsck.pointed) {
+        perror("Memory allocation failed");
+        free(fsck.owner);
+        free(fsck.pointed);
+        return -1;
+    }
+    for (uint32_t block = 0; block < fsck.system_blocks; block++) {
+        fsck.owner[block] = OWNER_SYSTEM;
+    }
+
+    struct extent_list list = {0};
+    int status = add_node(&fsck, NULL, 0, img->sb.root_start, img->sb.root_blocks);
+
+    // One level of the tree at a time: all its chains are walked in
+    // parallel, then the directories among them give the next level
+    enum stats_phase phase = stats_enter(PHASE_FAT);
+    while (status == 0 && fsck.level_start < fsck.count) {
+        size_t level_end = fsck.count;
+        run_pool(&fsck, workers, level_end - fsck.level_start, claim_chain);
+        run_pool(&fsck, workers, level_end - fsck.level_start, settle_chain);
+        run_pool(&fsck, workers, level_end - fsck.level_start, release_tail);
+
+        stats_enter(PHASE_RESOLVE);
+        for (size_t i = fsck.level_start; i < level_end && status == 0; i++) {
+            if (!fsck.nodes[i].entry || entry_is_dir(fsck.nodes[i].entry)) {
+                status = add_children(&fsck, i, &list);
+            }
+        }
+        stats_enter(PHASE_FAT);
+        fsck.level_start = level_end;
+    }
+
+    size_t chunks = (fsck.nblocks + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    run_pool(&fsck, workers, chunks, scan_lost);
+    run_pool(&fsck, workers, chunks, count_lost_heads);
+    if (fsck.lost_blocks > 0 && fsck.lost_chains == 0) {
+        fsck.lost_chains = 1;   // nothing but loops
+    }
+
+    struct fat_census census = {0}, summary = {0};
+    fat_scan(img->fat, img->fat_entries, workers, &census, NULL);
+    int summary_wrong = fat_summary_load(img, &summary) == 0 && memcmp(&census, &summary, sizeof(census)) != 0;
+    stats_enter(phase);
+
+    if (status < 0) {
+        extent_list_free(&list);
+        free(fsck.nodes);
+        free(fsck.owner);
+        free(fsck.pointed);
+        return -1;
+    }
+
+    // Report everything, then repair it
+    int problems = 0;
+    uint32_t files = 0, directories = 0;
+    for (size_t i = 0; i < fsck.count; i++) {
+        const struct fsck_node *node = &fsck.nodes[i];
+        if (!node->entry || entry_is_dir(node->entry)) {
+            directories++;
+        } else {
+            files++;
+        }
+        int found = node_problems(&fsck, node);
+        if (found) {
+            problems += report_node(&fsck, i, found);
+        }
+    }
+    if (fsck.lost_blocks > 0) {
+        printf("Lost chains: %u (%u blocks)\n", fsck.lost_chains, fsck.lost_blocks);
+        problems++;
+    }
+    if (summary_wrong) {
+        printf("FAT summary: %u free, %u reserved, %u allocated, but the FAT has %u, %u, %u\n",
+               summary.free_blocks, summary.reserved_blocks, summary.allocated_blocks,
+               census.free_blocks, census.reserved_blocks, census.allocated_blocks);
+        problems++;
+    }
+
+    if (repair && problems > 0) {
+        for (size_t i = 0; i < fsck.count && status == 0; i++) {
+            int found = node_problems(&fsck, &fsck.nodes[i]);
+            if (found & ~PROBLEM_NAME) {
+                status = repair_node(&fsck, &fsck.nodes[i], &list);
+            }
+            if ((found & PROBLEM_NAME) && status == 0 && fsck.nodes[i].entry->status != STATUS_FREE) {
+                rename_node(&fsck, i);
+            }
+        }
+        for (uint32_t block = fsck.system_blocks; block < fsck.nblocks && status == 0; block++) {
+            if (is_lost(&fsck, block)) {
+                fat_set(img, block, FAT_FREE);
+            }
+        }
+
+        phase = stats_enter(PHASE_FLUSH);
+        if (status == 0) {
+            struct fat_census repaired = {0};
+            fat_census(img->fat, img->fat_entries, &repaired);
+            stats_fat(img->fat_entries);
+            fat_summary_store(img, &repaired);
+            status = journal_commit(img);
+        }
+        if (status == 0) {
+            fat_summary_seal(img);
+        }
+        stats_enter(phase);
+    }
+
+    printf("Checked %u directories and %u files.\n", directories, files);
+    if (problems == 0) {
+        printf("No problems found.\n");
+    } else {
+        printf("%d problems found%s.\n", problems, repair && status == 0 ? " and repaired" : "");
+    }
+
+    extent_list_free(&list);
+    free(fsck.nodes);
+    free(fsck.owner);
+    free(fsck.pointed);
+    return status < 0 ? -1 : problems;
+}
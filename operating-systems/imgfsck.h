@@ -0,0 +1,21 @@
+#ifndef IMGFSCK_H
+#define IMGFSCK_H
+
+#include "diskimg.h"
+
+// Check the image's directory tree against its FAT and print every problem
+// found to stdout: chains that share blocks, loop, point outside the image,
+// run on past their entry or into a free entry, directory blocks missing from
+// the FAT, entries whose block_count or file_size disagree with their chain,
+// allocated blocks no entry reaches (lost chains), and a FAT summary that
+// disagrees with the FAT. The chains of each directory level are followed by
+// up to workers threads, each block claimed once in an ownership map, so the
+// whole check is linear in the size of the image.
+//
+// With repair, each problem is fixed by cutting chains back to the blocks
+// they own, bringing the entries in line with them, relinking directories,
+// freeing lost chains and rewriting the summary; the fixes are committed
+// through the journal. Returns the number of problems found, or -1 on error.
+int fsck_image(struct disk_image *img, int workers, int repair);
+
+#endif
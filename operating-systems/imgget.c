@@ -0,0 +1,501 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "imgget.h"
+#include "uring.h"
+#include "stats.h"
+
+// A file found by the tree walk, waiting to be extracted
+struct extract_job {
+    const struct dir_entry_t *entry;
+    char *host_path;
+};
+
+// Work queue shared by the extraction threads. Files are created relative to
+// the host directory's fd, from the part of their path below it.
+struct extract_queue {
+    const struct disk_image *img;
+    int root_fd;
+    size_t rel_offset;          // where that part starts in a job's host_path
+    struct extract_job *jobs;
+    size_t count;
+    size_t capacity;
+    size_t next_job;            // claimed atomically by the workers
+    unsigned failures;
+};
+
+// Function prototypes
+int walk_tree(const struct disk_image *img, uint32_t start_block, uint32_t block_count,
+              int dir_fd, const char *host_dir, uint64_t *visited, struct extract_queue *queue);
+
+// Function to find a file by its path; every component but the last must
+// name a directory
+const struct dir_entry_t *find_file(const struct disk_image *img, const char *filepath) {
+    char *path_copy = strdup(filepath);
+    char *token = strtok(path_copy, "/");
+    uint32_t start_block = img->sb.root_start;
+    uint32_t block_count = img->sb.root_blocks;
+    const struct dir_entry_t *entry = NULL;
+
+    while (token) {
+        char *next_token = strtok(NULL, "/");
+        entry = dir_find(img, start_block, block_count, token, next_token ? ENTRY_DIR : ENTRY_ANY);
+        if (!entry) {
+            break; // File not found
+        }
+
+        // Move to the starting block of the directory or file
+        start_block = entry_start_block(entry);
+        block_count = entry_block_count(entry);
+        token = next_token;
+    }
+
+    free(path_copy);
+    return entry;
+}
+
+// io_uring queue depth for copies to regular files, 0 for none
+static unsigned get_queue_depth;
+
+void set_get_queue_depth(unsigned depth) {
+    get_queue_depth = depth;
+}
+
+// Whether all-zero blocks of a file also become holes in regular outputs
+static int get_sparse;
+
+void set_get_sparse(int sparse) {
+    get_sparse = sparse;
+}
+
+// Function to check whether the block at offset in the image, cut short at
+// offset end of its run, is all zeros
+static int block_is_zero(const struct disk_image *img, off_t offset, off_t end) {
+    size_t len = end - offset < img->sb.block_size ? end - offset : img->sb.block_size;
+    return bytes_are_zero(img->map + offset, len);
+}
+
+// Function to copy len bytes of a run starting at block to a regular file,
+// skipping over the output instead of writing wherever the image file has a
+// hole and, for sparse gets, wherever a block is all zeros. Sets *skipped if
+// anything was skipped, as the output must then be cut to its final length.
+static int copy_run_sparse(const struct disk_image *img, uint32_t block, size_t len, int out_fd,
+                           enum copy_method *method, int *skipped) {
+    uint16_t block_size = img->sb.block_size;
+    off_t start = (off_t)block * block_size;
+    size_t pos = 0;
+
+    while (pos < len) {
+        // Blocks wholly inside a hole of the image are zeros by definition
+        off_t data = lseek(img->fd, start + pos, SEEK_DATA);
+        size_t data_at = data < 0 ? (errno == ENXIO ? len : pos)
+                                  : ((size_t)(data - start) < len ? (size_t)(data - start) : len);
+        data_at = data_at < len ? data_at / block_size * block_size : len;
+        if (data_at > pos) {
+            if (lseek(out_fd, data_at - pos, SEEK_CUR) < 0) {
+                return -1;
+            }
+            *skipped = 1;
+            pos = data_at;
+            continue;
+        }
+
+        // The rest, up to the next hole, holds data
+        off_t hole = lseek(img->fd, start + pos, SEEK_HOLE);
+        size_t hole_at = hole < 0 || (size_t)(hole - start) >= len ? len
+                       : ((size_t)(hole - start) + block_size - 1) / block_size * block_size;
+        if (hole_at > len) {
+            hole_at = len;
+        }
+
+        // A sparse get checks the data block by block for zeros, copying or
+        // skipping each stretch of one kind
+        while (pos < hole_at) {
+            size_t end = hole_at;
+            int zero = 0;
+            if (get_sparse) {
+                zero = block_is_zero(img, start + pos, start + hole_at);
+                end = pos;
+                do {
+                    end = end + block_size < hole_at ? end + block_size : hole_at;
+                } while (end < hole_at && block_is_zero(img, start + end, start + hole_at) == zero);
+            }
+
+            if (zero) {
+                if (lseek(out_fd, end - pos, SEEK_CUR) < 0) {
+                    return -1;
+                }
+                *skipped = 1;
+            } else if (image_copy_out(img, block + pos / block_size, end - pos, out_fd, method) < 0) {
+                return -1;
+            }
+            pos = end;
+        }
+    }
+    return 0;
+}
+
+// Function to copy a file's extents to a regular file through io_uring, from
+// the output's current offset on; returns 1 when io_uring is not available
+static int uring_get(const struct disk_image *img, const struct extent_list *extents,
+                     uint32_t file_size, int out_fd) {
+    struct stat st;
+    off_t base = lseek(out_fd, 0, SEEK_CUR);
+    if (fstat(out_fd, &st) < 0 || !S_ISREG(st.st_mode) || base < 0) {
+        return 1;
+    }
+
+    struct uring ring;
+    if (uring_init(&ring, get_queue_depth) < 0) {
+        return 1;
+    }
+
+    struct copy_segment *segs = malloc((extents->count ? extents->count : 1) * sizeof(struct copy_segment));
+    if (!segs) {
+        perror("Memory allocation failed");
+        uring_exit(&ring);
+        return -1;
+    }
+
+    // One segment per extent, the last one cut to the end of the file
+    size_t count = 0;
+    off_t file_offset = 0;
+    for (size_t i = 0; i < extents->count && file_offset < file_size; i++) {
+        size_t run_size = (size_t)extents->runs[i].count * img->sb.block_size;
+        segs[count].src_offset = (off_t)extents->runs[i].start * img->sb.block_size;
+        segs[count].dst_offset = base + file_offset;
+        size_t left = (size_t)(file_size - file_offset);   // positive, as the loop checks
+        segs[count].len = left < run_size ? left : run_size;
+        stats_access(segs[count].src_offset, segs[count].len);
+        file_offset += segs[count].len;
+        count++;
+    }
+
+    int status = uring_copy(&ring, img->fd, out_fd, segs, count, URING_CHUNK, NULL, NULL);
+    if (status == 0 && lseek(out_fd, base + file_offset, SEEK_SET) < 0) {
+        status = -1;
+    }
+
+    free(segs);
+    uring_exit(&ring);
+    return status;
+}
+
+// Function to write a file's contents to out_fd, one contiguous run at a time
+int stream_file(const struct disk_image *img, const struct dir_entry_t *entry, int out_fd) {
+    uint16_t block_size = img->sb.block_size;
+    uint32_t remaining_size = entry_file_size(entry);
+    uint32_t blocks_needed = (remaining_size + block_size - 1) / block_size;
+
+    // Resolve the whole FAT chain up front
+    struct extent_list extents = {0};
+    enum stats_phase phase = stats_enter(PHASE_FAT);
+    if (chain_extents(img, entry_start_block(entry), blocks_needed, &extents) < 0) {
+        extent_list_free(&extents);
+        stats_enter(phase);
+        return -1;
+    }
+    stats_enter(PHASE_COPY);
+
+    // With a queue depth set, overlap the image reads and output writes
+    if (get_queue_depth > 0 && !get_sparse) {
+        int status = uring_get(img, &extents, remaining_size, out_fd);
+        if (status <= 0) {
+            if (status < 0) {
+                fprintf(stderr, "Error writing output file.\n");
+            }
+            extent_list_free(&extents);
+            stats_enter(phase);
+            return status;
+        }
+    }
+
+    // Hand each contiguous run to the kernel in one call, falling back to a
+    // plain write out of the mapping if it refuses (copy_file_range cannot
+    // write to pipes or terminals, sendfile can write to pipes). A regular
+    // output is left with holes where the file has them in the image.
+    struct stat st;
+    int seekable = fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) && lseek(out_fd, 0, SEEK_CUR) >= 0;
+    enum copy_method method = COPY_FILE_RANGE;
+    int skipped = 0;
+    int status = 0;
+    for (size_t i = 0; i < extents.count && remaining_size > 0; i++) {
+        size_t run_size = (size_t)extents.runs[i].count * block_size;
+        size_t to_write = (remaining_size < run_size) ? remaining_size : run_size;
+
+        if (seekable) {
+            status = copy_run_sparse(img, extents.runs[i].start, to_write, out_fd, &method, &skipped);
+        } else {
+            status = image_copy_out(img, extents.runs[i].start, to_write, out_fd, &method);
+        }
+        if (status < 0) {
+            perror("Error writing output file");
+            break;
+        }
+        remaining_size -= to_write;
+    }
+
+    // Skipping a hole at the end of the file does not make it longer
+    if (status == 0 && skipped) {
+        off_t end = lseek(out_fd, 0, SEEK_CUR);
+        if (end < 0 || ftruncate(out_fd, end) < 0) {
+            perror("Error writing output file");
+            status = -1;
+        }
+    }
+
+    extent_list_free(&extents);
+    stats_enter(phase);
+    return status;
+}
+
+// Function to copy the file at a path to the host system
+int get_file(const struct disk_image *img, const char *filepath, const char *output_filename) {
+    // Find the file in the file system
+    enum stats_phase phase = stats_enter(PHASE_RESOLVE);
+    const struct dir_entry_t *entry = find_file(img, filepath);
+    stats_enter(phase);
+    if (!entry) {
+        fprintf(stderr, "File not found.\n");
+        return -1;
+    }
+
+    // Copy the file to the host operating system
+    return copy_file(img, entry, output_filename);
+}
+
+// Function to copy a file to the host system; "-" writes it to stdout
+int copy_file(const struct disk_image *img, const struct dir_entry_t *entry,
+              const char *output_filename) {
+    if (strcmp(output_filename, "-") == 0) {
+        return stream_file(img, entry, STDOUT_FILENO);
+    }
+
+    int out_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+        perror("Error creating output file");
+        return -1;
+    }
+
+    int status = stream_file(img, entry, out_fd);
+    close(out_fd);
+    return status;
+}
+
+// Function to open path below dir_fd without following a symlink or leaving
+// the directory on the way. Kernels without openat2 only keep the last
+// component from being a symlink; the tree walk checked the directories above.
+static int open_beneath(int dir_fd, const char *path, int flags, mode_t mode) {
+    struct open_how how = { .flags = flags, .mode = mode,
+                            .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS };
+    int fd = syscall(__NR_openat2, dir_fd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) {
+        return fd;
+    }
+    return openat(dir_fd, path, flags | O_NOFOLLOW, mode);
+}
+
+// Function to extract a file found by the tree walk
+static int extract_file(const struct extract_queue *queue, const struct extract_job *job) {
+    int out_fd = open_beneath(queue->root_fd, job->host_path + queue->rel_offset,
+                              O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0666);
+    if (out_fd < 0) {
+        perror(job->host_path);
+        return -1;
+    }
+
+    int status = stream_file(queue->img, job->entry, out_fd);
+    close(out_fd);
+    return status;
+}
+
+static int queue_push(struct extract_queue *queue, const struct dir_entry_t *entry, char *host_path) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 256;
+        struct extract_job *jobs = realloc(queue->jobs, capacity * sizeof(struct extract_job));
+        if (!jobs) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        queue->jobs = jobs;
+        queue->capacity = capacity;
+    }
+
+    queue->jobs[queue->count].entry = entry;
+    queue->jobs[queue->count].host_path = host_path;
+    queue->count++;
+    return 0;
+}
+
+// Function to walk a directory subtree, creating the host directories as it
+// goes and queueing every file for extraction. dir_fd is host_dir, opened.
+// Entries whose names would lead out of their directory are reported and
+// skipped, and an existing symlink is never followed.
+int walk_tree(const struct disk_image *img, uint32_t start_block, uint32_t block_count,
+              int dir_fd, const char *host_dir, uint64_t *visited, struct extract_queue *queue) {
+    // A directory reachable twice means the image has a cycle; walk it once
+    if (start_block < img->size / img->sb.block_size) {
+        if (visited[start_block / 64] >> (start_block % 64) & 1) {
+            return 0;
+        }
+        visited[start_block / 64] |= (uint64_t)1 << (start_block % 64);
+    }
+
+    if (!image_contains(img, start_block, 1)) {
+        fprintf(stderr, "Error: Directory %s lies outside the disk image.\n", host_dir);
+        return -1;
+    }
+
+    struct dir_iter it;
+    const struct dir_entry_t *entry;
+    int status = 0;
+
+    dir_iter_init(&it, img, start_block, block_count);
+    while ((entry = dir_iter_next(&it))) {
+        if (!entry_in_use(entry) || entry_name_eq(entry, ".") || entry_name_eq(entry, "..")) {
+            continue;
+        }
+        if (!entry_name_is_safe(entry)) {
+            fprintf(stderr, "Error: Skipping an entry of %s named \"%.*s\", which is not a valid file name.\n",
+                    host_dir, entry_name_len(entry), entry->filename);
+            status = -1;
+            continue;
+        }
+
+        size_t path_size = strlen(host_dir) + 32;
+        char *host_path = malloc(path_size);
+        if (!host_path) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        snprintf(host_path, path_size, "%s/%.*s", host_dir, entry_name_len(entry), entry->filename);
+        const char *name = host_path + strlen(host_dir) + 1;
+
+        if (entry_is_dir(entry)) {
+            int sub_fd = -1;
+            if (mkdirat(dir_fd, name, 0777) < 0 && errno != EEXIST) {
+                perror(host_path);
+                status = -1;
+            } else if ((sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+                perror(host_path);
+                status = -1;
+            } else if (walk_tree(img, entry_start_block(entry), entry_block_count(entry),
+                                 sub_fd, host_path, visited, queue) < 0) {
+                status = -1;
+            }
+            if (sub_fd >= 0) {
+                close(sub_fd);
+            }
+            free(host_path);
+        } else if (queue_push(queue, entry, host_path) < 0) {
+            free(host_path);
+            return -1;
+        }
+    }
+    return status;
+}
+
+static void *extract_worker(void *arg) {
+    struct extract_queue *queue = arg;
+
+    for (;;) {
+        size_t job = __atomic_fetch_add(&queue->next_job, 1, __ATOMIC_RELAXED);
+        if (job >= queue->count) {
+            break;
+        }
+        if (extract_file(queue, &queue->jobs[job]) < 0) {
+            __atomic_fetch_add(&queue->failures, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Function to extract a whole directory subtree into a host directory, with
+// the files copied concurrently by a pool of worker threads
+static int extract_subtree(const struct disk_image *img, const char *dir_path, const char *host_dir,
+                           int workers) {
+    uint32_t start_block = img->sb.root_start;
+    uint32_t block_count = img->sb.root_blocks;
+
+    if (strcmp(dir_path, "/") != 0) {
+        const struct dir_entry_t *dir = find_file(img, dir_path);
+        if (!dir || !entry_is_dir(dir)) {
+            fprintf(stderr, "Error: Subdirectory %s not found.\n", dir_path);
+            return -1;
+        }
+        start_block = entry_start_block(dir);
+        block_count = entry_block_count(dir);
+    }
+
+    if (mkdir(host_dir, 0777) < 0 && errno != EEXIST) {
+        perror(host_dir);
+        return -1;
+    }
+
+    // Walk the tree first; the directory structure is tiny next to the data
+    struct extract_queue queue = {0};
+    queue.img = img;
+    queue.root_fd = open(host_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    queue.rel_offset = strlen(host_dir) + 1;
+    if (queue.root_fd < 0) {
+        perror(host_dir);
+        return -1;
+    }
+    uint64_t *visited = calloc((img->size / img->sb.block_size) / 64 + 1, sizeof(uint64_t));
+    if (!visited) {
+        perror("Memory allocation failed");
+        close(queue.root_fd);
+        return -1;
+    }
+    int status = walk_tree(img, start_block, block_count, queue.root_fd, host_dir, visited, &queue);
+    free(visited);
+
+    if ((size_t)workers > queue.count) {
+        workers = queue.count ? queue.count : 1;
+    }
+
+    // The calling thread is one of the workers
+    stats_enter(PHASE_COPY);
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 1; threads && i < workers; i++) {
+        if (pthread_create(&threads[started], NULL, extract_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+    extract_worker(&queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (queue.failures > 0) {
+        fprintf(stderr, "Error: %u files could not be extracted.\n", queue.failures);
+        status = -1;
+    }
+
+    for (size_t i = 0; i < queue.count; i++) {
+        free(queue.jobs[i].host_path);
+    }
+    free(queue.jobs);
+    close(queue.root_fd);
+    return status;
+}
+
+int extract_tree(const struct disk_image *img, const char *dir_path, const char *host_dir, int workers) {
+    enum stats_phase phase = stats_enter(PHASE_RESOLVE);
+    int status = extract_subtree(img, dir_path, host_dir, workers);
+    stats_enter(phase);
+    return status;
+}
@@ -0,0 +1,31 @@
+#ifndef IMGGET_H
+#define IMGGET_H
+
+#include "diskimg.h"
+
+// Find a file or directory by its path; returns NULL if it does not exist
+const struct dir_entry_t *find_file(const struct disk_image *img, const char *filepath);
+
+// Copy files to regular output files through io_uring with up to depth
+// chunks in flight; 0 (the default) uses copy_file_range and friends
+void set_get_queue_depth(unsigned depth);
+
+// Also leave holes in regular output files for blocks that are all zeros,
+// not only for holes in the image file
+void set_get_sparse(int sparse);
+
+// Write a file's contents to out_fd
+int stream_file(const struct disk_image *img, const struct dir_entry_t *entry, int out_fd);
+
+// Copy a file to the host system; "-" writes it to stdout
+int copy_file(const struct disk_image *img, const struct dir_entry_t *entry,
+              const char *output_filename);
+
+// Copy the file at filepath to output_filename, reporting a missing file
+int get_file(const struct disk_image *img, const char *filepath, const char *output_filename);
+
+// Extract a whole directory subtree into a host directory, with the files
+// copied concurrently by up to workers threads
+int extract_tree(const struct disk_image *img, const char *dir_path, const char *host_dir, int workers);
+
+#endif
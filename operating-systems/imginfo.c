@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "imginfo.h"
+#include "stats.h"
+
+// Function to print the superblock, FAT and optional fragmentation information
+void print_image_info(const struct disk_image *img, int workers, int show_frag, int use_summary) {
+    // Print superblock information
+    printf("Super block information:\n");
+    printf("Block size: %u\n", img->sb.block_size);
+    printf("Block count: %u\n", img->sb.block_count);
+    printf("FAT starts: %u\n", img->sb.fat_start);
+    printf("FAT blocks: %u\n", img->sb.fat_blocks);
+    printf("Root directory start: %u\n", img->sb.root_start);
+    printf("Root directory blocks: %u\n", img->sb.root_blocks);
+
+    // Variables for FAT information
+    uint32_t free_blocks = 0, reserved_blocks = 0, allocated_blocks = 0;
+
+    struct fat_frag frag = {0};
+
+    // Read FAT information
+    read_fat(img, workers, use_summary, &free_blocks, &reserved_blocks, &allocated_blocks,
+             show_frag ? &frag : NULL);
+
+    // Print FAT information
+    printf("\nFAT information:\n");
+    printf("Free Blocks: %u\n", free_blocks);
+    printf("Reserved Blocks: %u\n", reserved_blocks);
+    printf("Allocated Blocks: %u\n", allocated_blocks);
+
+    // Print fragmentation information
+    if (show_frag) {
+        printf("\nFragmentation information:\n");
+        printf("Chains: %u\n", frag.chains);
+        printf("Runs: %u\n", frag.runs);
+        printf("Average run length: %.2f\n", frag.runs ? (double)allocated_blocks / frag.runs : 0.0);
+        printf("Free runs: %u\n", frag.free_runs);
+        printf("Longest free run: %u\n", frag.longest_free_run);
+    }
+}
+
+// Function to count the FAT entries of each kind, and optionally measure
+// fragmentation. The counts come from the superblock summary when it is
+// valid; otherwise the FAT is scanned, split across worker threads.
+void read_fat(const struct disk_image *img, int workers, int use_summary, uint32_t *free_blocks,
+              uint32_t *reserved_blocks, uint32_t *allocated_blocks, struct fat_frag *frag) {
+    struct fat_census census = {0};
+    enum stats_phase phase = stats_enter(PHASE_FAT);
+
+    if (frag || !use_summary || fat_summary_load(img, &census) < 0) {
+        fat_scan(img->fat, img->fat_entries, workers, &census, frag);
+    }
+    stats_enter(phase);
+
+    *free_blocks += census.free_blocks;
+    *reserved_blocks += census.reserved_blocks;
+    *allocated_blocks += census.allocated_blocks;
+}
@@ -0,0 +1,19 @@
+#ifndef IMGINFO_H
+#define IMGINFO_H
+
+#include <stdint.h>
+
+#include "diskimg.h"
+#include "fatscan.h"
+
+// Count the FAT entries of each kind, and optionally measure fragmentation.
+// The counts come from the superblock summary when use_summary is set and it
+// is valid; otherwise the FAT is scanned by up to workers threads.
+void read_fat(const struct disk_image *img, int workers, int use_summary, uint32_t *free_blocks,
+              uint32_t *reserved_blocks, uint32_t *allocated_blocks, struct fat_frag *frag);
+
+// Print the superblock and FAT information to stdout, with the
+// fragmentation section when show_frag is set
+void print_image_info(const struct disk_image *img, int workers, int show_frag, int use_summary);
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "imglist.h"
+#include "stats.h"
+
+// A subdirectory seen while listing its parent, walked once the parent is done
+struct pending_dir {
+    uint32_t start_block;
+    uint32_t block_count;
+    char *path;
+};
+
+// Function to list a directory, found by its path
+static int list_path(const struct disk_image *img, const char *dir_path,
+                     enum list_format format, int recursive) {
+    uint32_t dir_start_block = img->sb.root_start;
+    uint32_t dir_block_count = img->sb.root_blocks;
+
+    // Check if a subdirectory path is provided
+    if (strcmp(dir_path, "/") != 0) {
+        const char *sub_dir = dir_path + 1; // Skip the leading '/'
+        if (!find_subdirectory(img, sub_dir, &dir_start_block, &dir_block_count)) {
+            fprintf(stderr, "Error: Subdirectory %s not found.\n", dir_path);
+            return -1;
+        }
+    }
+
+    // Paths are printed without a trailing '/', so the root is the empty string
+    char *path = strdup(dir_path);
+    if (!path) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    size_t path_len = strlen(path);
+    while (path_len > 0 && path[path_len - 1] == '/') {
+        path[--path_len] = '\0';
+    }
+
+    struct list_context ctx = { .img = img, .format = format };
+
+    // One bit per block for the directories already listed; NULL lists just
+    // the one directory
+    if (recursive) {
+        ctx.visited = calloc(img->size / img->sb.block_size / 64 + 1, sizeof(uint64_t));
+        if (!ctx.visited) {
+            perror("Memory allocation failed");
+            free(path);
+            return -1;
+        }
+    }
+
+    // Read and display the directory contents
+    int status = read_directory(&ctx, dir_start_block, dir_block_count, path);
+
+    free(ctx.path_buf);
+    free(ctx.visited);
+    free(path);
+    return status;
+}
+
+int list_directory(const struct disk_image *img, const char *dir_path,
+                   enum list_format format, int recursive) {
+    enum stats_phase phase = stats_enter(PHASE_RESOLVE);
+    int status = list_path(img, dir_path, format, recursive);
+    stats_enter(phase);
+    return status;
+}
+
+int find_subdirectory(const struct disk_image *img, const char *path,
+                      uint32_t *sub_start_block, uint32_t *sub_block_count) {
+    char *path_copy = strdup(path); // Make a copy of the path
+    char *token = strtok(path_copy, "/"); // Tokenize the path into directory names
+
+    uint32_t current_start_block = img->sb.root_start;
+    uint32_t current_block_count = img->sb.root_blocks;
+
+    while (token) {
+        // Look the name up among the current directory's subdirectories
+        struct dir_entry_t *entry = dir_find(img, current_start_block, current_block_count, token,
+                                             ENTRY_DIR);
+        if (!entry) {
+            free(path_copy);
+            return 0; // Subdirectory not found
+        }
+
+        current_start_block = entry_start_block(entry);
+        current_block_count = entry_block_count(entry);
+        token = strtok(NULL, "/"); // Move to the next level of the path
+    }
+
+    *sub_start_block = current_start_block;
+    *sub_block_count = current_block_count;
+    free(path_copy);
+    return 1; // Successfully found the target subdirectory
+}
+
+// Function to print a string as the body of a JSON string literal
+static void print_json_string(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            putchar('\\');
+            putchar(c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+}
+
+// Function to print one directory entry; path is the directory holding it
+int print_entry(struct list_context *ctx, const struct dir_entry_t *entry, const char *path) {
+    enum list_format format = ctx->format;
+    char type = entry_is_dir(entry) ? 'D' : 'F';
+    uint32_t size = (type == 'D') ? 0 : entry_file_size(entry);
+    int name_len = entry_name_len(entry);
+
+    if (format == FORMAT_TEXT) {
+        printf("%c %10u %30.*s %04u/%02u/%02u %02u:%02u:%02u\n",
+               type,
+               size,
+               name_len, entry->filename,
+               ntohs(entry->modify_year), // Convert to host byte order
+               entry->modify_month,
+               entry->modify_day,
+               entry->modify_hour,
+               entry->modify_minute,
+               entry->modify_second);
+    } else if (format == FORMAT_JSON) {
+        fputs("{\"path\":\"", stdout);
+        print_json_string(path, strlen(path));
+        putchar('/');
+        print_json_string(entry->filename, name_len);
+        printf("\",\"type\":\"%c\",\"size\":%u,\"start\":%u,\"blocks\":%u,"
+               "\"modified\":\"%04u-%02u-%02uT%02u:%02u:%02u\"}\n",
+               type, size, entry_start_block(entry), entry_block_count(entry),
+               ntohs(entry->modify_year), entry->modify_month, entry->modify_day,
+               entry->modify_hour, entry->modify_minute, entry->modify_second);
+    } else {
+        size_t path_len = strlen(path) + 1 + name_len;
+        if (path_len + 1 > ctx->path_size) {
+            size_t size = ctx->path_size ? ctx->path_size : 256;
+            while (size < path_len + 1) {
+                size *= 2;
+            }
+            char *grown = realloc(ctx->path_buf, size);
+            if (!grown) {
+                perror("Memory allocation failed");
+                return -1;
+            }
+            ctx->path_buf = grown;
+            ctx->path_size = size;
+        }
+        snprintf(ctx->path_buf, ctx->path_size, "%s/%.*s", path, name_len, entry->filename);
+
+        struct list_record record = {0};
+        record.type = type;
+        record.path_len = htons(path_len > UINT16_MAX ? UINT16_MAX : path_len);
+        record.file_size = htonl(size);
+        record.starting_block = entry->starting_block;
+        record.block_count = entry->block_count;
+        record.modify_year = entry->modify_year;
+        record.modify_month = entry->modify_month;
+        record.modify_day = entry->modify_day;
+        record.modify_hour = entry->modify_hour;
+        record.modify_minute = entry->modify_minute;
+        record.modify_second = entry->modify_second;
+        fwrite(&record, sizeof(record), 1, stdout);
+
+        // Paths longer than the length field are cut short
+        fwrite(ctx->path_buf, 1, ntohs(record.path_len), stdout);
+    }
+    return 0;
+}
+
+// Function to read and display directory contents, and with a visited map,
+// the contents of every directory below it
+int read_directory(struct list_context *ctx, uint32_t start_block, uint32_t block_count,
+                   const char *path) {
+    const struct disk_image *img = ctx->img;
+    uint64_t *visited = ctx->visited;
+    struct dir_iter it;
+    const struct dir_entry_t *entry;
+
+    // A directory reachable twice means the image has a cycle; list it once
+    if (visited && start_block < img->size / img->sb.block_size) {
+        if (visited[start_block / 64] >> (start_block % 64) & 1) {
+            return 0;
+        }
+        visited[start_block / 64] |= (uint64_t)1 << (start_block % 64);
+    }
+
+    if (!image_contains(img, start_block, 1)) {
+        fprintf(stderr, "ERROR: Directory block %u lies outside the disk image.\n", start_block);
+        return -1;
+    }
+
+    // The recursive text listing heads each directory with its path, as ls -R does
+    if (visited && ctx->format == FORMAT_TEXT) {
+        printf("%s:\n", path[0] ? path : "/");
+    }
+
+    struct pending_dir *pending = NULL;
+    size_t pending_count = 0, pending_capacity = 0;
+    int status = 0;
+
+    // Parse each directory entry, one block of the directory at a time
+    dir_iter_init(&it, img, start_block, block_count);
+    while ((entry = dir_iter_next(&it))) {
+        // Skip unused or invalid entries
+        if (!entry_in_use(entry)) {
+            continue;
+        }
+
+        if (print_entry(ctx, entry, path) < 0) {
+            status = -1;
+            break;
+        }
+
+        // Remember subdirectories so the walk needs no second pass over this one
+        if (!visited || !entry_is_dir(entry) ||
+            entry_name_eq(entry, ".") || entry_name_eq(entry, "..")) {
+            continue;
+        }
+        if (pending_count == pending_capacity) {
+            size_t capacity = pending_capacity ? pending_capacity * 2 : 16;
+            struct pending_dir *grown = realloc(pending, capacity * sizeof(struct pending_dir));
+            if (!grown) {
+                perror("Memory allocation failed");
+                status = -1;
+                break;
+            }
+            pending = grown;
+            pending_capacity = capacity;
+        }
+
+        size_t path_size = strlen(path) + 32;
+        char *sub_path = malloc(path_size);
+        if (!sub_path) {
+            perror("Memory allocation failed");
+            status = -1;
+            break;
+        }
+        snprintf(sub_path, path_size, "%s/%.*s", path, entry_name_len(entry), entry->filename);
+
+        pending[pending_count].start_block = entry_start_block(entry);
+        pending[pending_count].block_count = entry_block_count(entry);
+        pending[pending_count].path = sub_path;
+        pending_count++;
+    }
+
+    for (size_t i = 0; i < pending_count; i++) {
+        if (status == 0) {
+            if (ctx->format == FORMAT_TEXT) {
+                putchar('\n');
+            }
+            if (read_directory(ctx, pending[i].start_block, pending[i].block_count,
+                               pending[i].path) < 0) {
+                status = -1;
+            }
+        }
+        free(pending[i].path);
+    }
+    free(pending);
+    return status;
+}
@@ -0,0 +1,56 @@
+#ifndef IMGLIST_H
+#define IMGLIST_H
+
+#include <stdint.h>
+
+#include "diskimg.h"
+
+enum list_format { FORMAT_TEXT, FORMAT_JSON, FORMAT_BINARY };
+
+// Fixed part of a binary listing record, followed by path_len bytes of path.
+// Integers are big-endian, like the image itself.
+struct list_record {
+    uint8_t type;               // 'F' or 'D'
+    uint8_t reserved;
+    uint16_t path_len;
+    uint32_t file_size;
+    uint32_t starting_block;
+    uint32_t block_count;
+    uint16_t modify_year;
+    uint8_t modify_month;
+    uint8_t modify_day;
+    uint8_t modify_hour;
+    uint8_t modify_minute;
+    uint8_t modify_second;
+    uint8_t pad;
+} __attribute__((packed));
+
+// State shared by one listing: how entries are printed, which directories
+// have been listed already (NULL lists just the one directory), and a buffer
+// for building entry paths, grown as deeper paths need it
+struct list_context {
+    const struct disk_image *img;
+    enum list_format format;
+    uint64_t *visited;
+    char *path_buf;
+    size_t path_size;
+};
+
+// List the directory at dir_path to stdout, and with recursive every
+// directory below it; returns -1 if it does not exist or a listing failed
+int list_directory(const struct disk_image *img, const char *dir_path,
+                   enum list_format format, int recursive);
+
+// Find the directory at path (relative to the root); returns 0 if it is missing
+int find_subdirectory(const struct disk_image *img, const char *path,
+                      uint32_t *sub_start_block, uint32_t *sub_block_count);
+
+// Print one directory entry; path is the directory holding it. Returns -1 if
+// the entry's path could not be built.
+int print_entry(struct list_context *ctx, const struct dir_entry_t *entry, const char *path);
+
+// List one directory, and with a visited map every directory below it
+int read_directory(struct list_context *ctx, uint32_t start_block, uint32_t block_count,
+                   const char *path);
+
+#endif
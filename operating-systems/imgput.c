@@ -0,0 +1,892 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "imgput.h"
+#include "fatscan.h"
+#include "journal.h"
+#include "stats.h"
+
+// Largest amount of file data moved per read/write
+#define COPY_CHUNK (1 << 20)
+
+// Function to commit everything the puts so far changed, along with the new
+// counts, in one journal transaction
+int put_finish(struct put_context *ctx) {
+    struct fat_census census;
+    fat_census_of_map(ctx->img, ctx->free_map, &census);
+    fat_summary_store(ctx->img, &census);
+    ctx->uncommitted = 0;
+    if (journal_commit(ctx->img) < 0) {
+        return -1;
+    }
+    fat_summary_seal(ctx->img);
+
+    // Blocks the puts freed are no longer used by the image on disk
+    freemap_settle(ctx->free_map);
+    return 0;
+}
+
+// Function to stamp an entry's modify time with the current time
+static void set_modify_time(struct dir_entry_t *entry) {
+    time_t now = time(NULL);
+    struct tm *current_time = localtime(&now);
+
+    entry->modify_year = htons(current_time->tm_year + 1900);
+    entry->modify_month = current_time->tm_mon + 1;
+    entry->modify_day = current_time->tm_mday;
+    entry->modify_hour = current_time->tm_hour;
+    entry->modify_minute = current_time->tm_min;
+    entry->modify_second = current_time->tm_sec;
+}
+
+// Function to stamp an entry with the current time as both create and modify time
+void set_timestamps(struct dir_entry_t *entry) {
+    set_modify_time(entry);
+
+    entry->create_year = entry->modify_year;
+    entry->create_month = entry->modify_month;
+    entry->create_day = entry->modify_day;
+    entry->create_hour = entry->modify_hour;
+    entry->create_minute = entry->modify_minute;
+    entry->create_second = entry->modify_second;
+}
+
+// Function to find an unused entry in a directory, growing the directory by
+// one block when it is full. dir is the directory's own entry, or NULL for the
+// root, whose size is fixed by the superblock.
+struct dir_entry_t *take_dir_slot(struct put_context *ctx, struct dir_entry_t *dir,
+                                  uint32_t start_block, uint32_t *block_count) {
+    struct disk_image *img = ctx->img;
+
+    struct dir_entry_t *slot = dir_lookup_free_slot(ctx->dir_cache, img, start_block, *block_count);
+    if (slot || !dir) {
+        return slot;
+    }
+
+    // Find the directory's last block
+    uint32_t last_block = start_block;
+    for (uint32_t i = 1; i < *block_count; i++) {
+        uint32_t next = dir_next_block(img, last_block);
+        if (next == FAT_EOF) {
+            break;
+        }
+        last_block = next;
+    }
+
+    // Prefer the block right after it so the directory stays contiguous
+    uint32_t new_block = last_block + 1;
+    if (freemap_take(ctx->free_map, new_block) < 0) {
+        struct extent_list blocks = {0};
+        if (freemap_alloc(ctx->free_map, 1, &blocks) < 0) {
+            extent_list_free(&blocks);
+            return NULL;
+        }
+        new_block = blocks.runs[0].start;
+        extent_list_free(&blocks);
+    }
+
+    fat_set(img, last_block, new_block);
+    fat_set(img, new_block, FAT_EOF);
+    memset(image_block(img, new_block), 0, img->sb.block_size);
+    image_mark_dirty(img, new_block);
+
+    *block_count += 1;
+    dir->block_count = htonl(*block_count);
+    image_dirty_range(img, dir, sizeof(struct dir_entry_t));
+    dircache_invalidate(ctx->dir_cache, start_block);
+
+    return dir_lookup_free_slot(ctx->dir_cache, img, start_block, *block_count);
+}
+
+// Function to undo take_dir_slot growing a directory from old_count blocks,
+// once the slot it took is not going to be used: the block it added is
+// unlinked from the end of the directory and freed again
+static void release_dir_growth(struct put_context *ctx, struct dir_entry_t *dir,
+                               uint32_t start_block, uint32_t old_count, uint32_t block_count) {
+    struct disk_image *img = ctx->img;
+    if (!dir || block_count == old_count) {
+        return;
+    }
+
+    uint32_t last_block = start_block;
+    for (uint32_t i = 1; i < old_count; i++) {
+        last_block = dir_next_block(img, last_block);
+    }
+    uint32_t added = dir_next_block(img, last_block);
+
+    fat_set(img, last_block, FAT_EOF);
+    if (added != FAT_EOF) {
+        fat_set(img, added, FAT_FREE);
+        freemap_release(ctx->free_map, added, 1);
+    }
+
+    dir->block_count = htonl(old_count);
+    image_dirty_range(img, dir, sizeof(struct dir_entry_t));
+    dircache_invalidate(ctx->dir_cache, start_block);
+}
+
+// Function to give a file's blocks, not yet linked in the FAT, back to the free map
+static void release_extents(struct free_map *map, struct extent_list *extents) {
+    for (size_t i = 0; i < extents->count; i++) {
+        freemap_release(map, extents->runs[i].start, extents->runs[i].count);
+    }
+    extents->count = 0;
+}
+
+// Function to add count blocks to the end of a file, continuing its last run
+// while the blocks after it are free
+static int extend_extents(struct free_map *map, struct extent_list *extents, uint32_t count) {
+    if (extents->count > 0) {
+        struct extent *last = &extents->runs[extents->count - 1];
+        while (count > 0 && freemap_take(map, last->start + last->count) == 0) {
+            last->count++;
+            count--;
+        }
+    }
+    return freemap_alloc(map, count, extents);
+}
+
+// Function to write len bytes of file data starting at the file's block first
+static int write_extents(struct disk_image *img, const struct extent_list *extents, uint32_t first,
+                         const uint8_t *buf, size_t len) {
+    uint16_t block_size = img->sb.block_size;
+
+    for (size_t i = 0; i < extents->count && len > 0; i++) {
+        if (first >= extents->runs[i].count) {
+            first -= extents->runs[i].count;
+            continue;
+        }
+
+        size_t run_size = (size_t)(extents->runs[i].count - first) * block_size;
+        size_t to_write = len < run_size ? len : run_size;
+        if (image_write(img, extents->runs[i].start + first, buf, to_write) < 0) {
+            return -1;
+        }
+        buf += to_write;
+        len -= to_write;
+        first = 0;
+    }
+    return len == 0 ? 0 : -1;
+}
+
+// Function to zero count blocks of a file starting at the file's block first
+static int zero_extents(struct disk_image *img, const struct extent_list *extents, uint32_t first,
+                        uint32_t count) {
+    for (size_t i = 0; i < extents->count && count > 0; i++) {
+        if (first >= extents->runs[i].count) {
+            first -= extents->runs[i].count;
+            continue;
+        }
+
+        uint32_t to_zero = extents->runs[i].count - first < count ? extents->runs[i].count - first : count;
+        if (image_zero(img, extents->runs[i].start + first, to_zero) < 0) {
+            return -1;
+        }
+        count -= to_zero;
+        first = 0;
+    }
+    return count == 0 ? 0 : -1;
+}
+
+enum block_kind { BLOCK_SAME, BLOCK_ZERO, BLOCK_DATA };
+
+// Function to store len bytes of file data at the file's block first. zero
+// says the whole chunk is a hole in the input, which stays a hole in the
+// image file; with a sparse put, so does any block that is all zeros.
+static int store_chunk(struct put_context *ctx, const struct extent_list *extents, uint32_t first,
+                       const uint8_t *buf, size_t len, int zero) {
+    struct disk_image *img = ctx->img;
+    uint16_t block_size = img->sb.block_size;
+    uint32_t count = (len + block_size - 1) / block_size;
+
+    if (zero) {
+        return zero_extents(img, extents, first, count);
+    }
+    if (!ctx->sparse) {
+        return write_extents(img, extents, first, buf, len);
+    }
+
+    // Write or punch each stretch of blocks of one kind
+    enum block_kind kind = BLOCK_DATA;
+    uint32_t stretch = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        enum block_kind this_kind = BLOCK_DATA;
+        if (i < count) {
+            const uint8_t *p = buf + (size_t)i * block_size;
+            size_t n = i + 1 < count ? block_size : len - (size_t)i * block_size;
+            this_kind = bytes_are_zero(p, n) ? BLOCK_ZERO : BLOCK_DATA;
+            if (i > 0 && this_kind == kind) {
+                continue;
+            }
+        }
+
+        int status = 0;
+        if (i > 0 && kind == BLOCK_DATA) {
+            size_t from = (size_t)stretch * block_size;
+            size_t to = (size_t)i * block_size < len ? (size_t)i * block_size : len;
+            status = write_extents(img, extents, first + stretch, buf + from, to - from);
+        } else if (i > 0 && kind == BLOCK_ZERO) {
+            status = zero_extents(img, extents, first + stretch, i - stretch);
+        }
+        if (status < 0) {
+            return -1;
+        }
+        kind = this_kind;
+        stretch = i;
+    }
+    return 0;
+}
+
+// Function to read the next chunk of the input, which is at offset. A hole in
+// a regular file is not read at all: the chunk is zeroed up to the end of the
+// hole and *hole set. Data is read only up to the next hole, in whole blocks,
+// so that chunks are either all hole or all data.
+static ssize_t read_chunk(int fd, const struct stat *st, uint64_t offset, uint8_t *buf, size_t chunk,
+                          uint16_t block_size, int *hole) {
+    *hole = 0;
+    if (S_ISREG(st->st_mode) && offset < (uint64_t)st->st_size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            data = st->st_size;     // the hole runs to the end of the file
+        }
+
+        if (data > (off_t)offset) {
+            size_t len = (uint64_t)data - offset < chunk ? (uint64_t)data - offset : chunk;
+            if (offset + len < (uint64_t)st->st_size) {
+                len -= len % block_size;
+            }
+            if (len > 0 && lseek(fd, offset + len, SEEK_SET) >= 0) {
+                memset(buf, 0, len);
+                *hole = 1;
+                return len;
+            }
+        } else if (data == (off_t)offset) {
+            off_t next_hole = lseek(fd, offset, SEEK_HOLE);
+            if (next_hole > (off_t)offset) {
+                uint64_t len = ((uint64_t)next_hole - offset + block_size - 1) / block_size * block_size;
+                chunk = len < chunk ? len : chunk;
+            }
+        }
+
+        // Without hole support, the whole file is simply read
+        if (lseek(fd, offset, SEEK_SET) < 0) {
+            return -1;
+        }
+    }
+    return read_full(fd, buf, chunk);
+}
+
+// Function to check whether a regular file has holes
+static int input_has_holes(int fd, const struct stat *st) {
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    lseek(fd, 0, SEEK_SET);
+    return hole >= 0 && hole < st->st_size;
+}
+
+static void sync_written(void *arg, off_t offset, const void *buf, size_t len) {
+    image_sync_private(arg, offset, buf, len);
+}
+
+// Function to copy a regular file into its extents through io_uring
+static int uring_put(struct put_context *ctx, int input_fd, uint32_t file_size,
+                     const struct extent_list *extents) {
+    uint16_t block_size = ctx->img->sb.block_size;
+    struct copy_segment *segs = malloc((extents->count ? extents->count : 1) * sizeof(struct copy_segment));
+    if (!segs) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    // One segment per extent, the last one cut to the end of the file
+    size_t count = 0;
+    off_t file_offset = 0;
+    for (size_t i = 0; i < extents->count && file_offset < file_size; i++) {
+        size_t run_size = (size_t)extents->runs[i].count * block_size;
+        segs[count].src_offset = file_offset;
+        segs[count].dst_offset = (off_t)extents->runs[i].start * block_size;
+        size_t left = (size_t)(file_size - file_offset);   // positive, as the loop checks
+        segs[count].len = left < run_size ? left : run_size;
+        stats_access(segs[count].dst_offset, segs[count].len);
+        file_offset += segs[count].len;
+        count++;
+    }
+
+    sums_dirty(ctx->img);
+    int status = uring_copy(ctx->ring, input_fd, ctx->img->fd, segs, count, URING_CHUNK,
+                            sync_written, ctx->img);
+    free(segs);
+    return status;
+}
+
+// Function to open the file to put ("-" for stdin) and check that it fits
+static int open_input(const char *file_path, struct stat *st) {
+    int input_fd = strcmp(file_path, "-") == 0 ? STDIN_FILENO : open(file_path, O_RDONLY);
+    if (input_fd < 0) {
+        fprintf(stderr, "File not found.\n");
+        return -1;
+    }
+
+    if (fstat(input_fd, st) < 0) {
+        perror(file_path);
+    } else if (S_ISREG(st->st_mode) && st->st_size > UINT32_MAX) {
+        fprintf(stderr, "Error: %s is too large for the disk image.\n", file_path);
+    } else {
+        return input_fd;
+    }
+
+    if (input_fd != STDIN_FILENO) {
+        close(input_fd);
+    }
+    return -1;
+}
+
+// Function to add file entry. A regular file is allocated in one go from its
+// size; anything else ("-" for stdin, pipes, devices) is streamed, with blocks
+// allocated as the data arrives and the size recorded once it ends.
+int add_file_entry(struct put_context *ctx, const char *file_path, const char *filename,
+                   struct dir_entry_t *dir, uint32_t dir_start_block, uint32_t dir_block_count) {
+    struct disk_image *img = ctx->img;
+    uint16_t block_size = img->sb.block_size;
+
+    struct stat st;
+    int input_fd = open_input(file_path, &st);
+    if (input_fd < 0) {
+        return -1;
+    }
+    int sized = S_ISREG(st.st_mode);
+
+    uint32_t old_block_count = dir_block_count;
+    struct dir_entry_t *slot = take_dir_slot(ctx, dir, dir_start_block, &dir_block_count);
+    if (!slot) {
+        fprintf(stderr, "Error: Directory is full.\n");
+        if (input_fd != STDIN_FILENO) {
+            close(input_fd);
+        }
+        return -1;
+    }
+
+    // Allocate a file of known size up front, contiguously if any free run is large enough
+    struct extent_list extents = {0};
+    uint32_t blocks_allocated = 0;
+    if (sized) {
+        blocks_allocated = (st.st_size + block_size - 1) / block_size;
+        if (freemap_alloc(ctx->free_map, blocks_allocated, &extents) < 0) {
+            fprintf(stderr, "Error: Not enough free blocks available.\n");
+            extent_list_free(&extents);
+            release_dir_growth(ctx, dir, dir_start_block, old_block_count, dir_block_count);
+            if (input_fd != STDIN_FILENO) {
+                close(input_fd);
+            }
+            return -1;
+        }
+    }
+
+    // Copy the data in large chunks of whole blocks, growing the allocation
+    // whenever the input runs past it; with a ring, a regular file's chunks
+    // are all in flight at once instead
+    size_t chunk = COPY_CHUNK / block_size * block_size;
+    uint8_t *buffer = malloc(chunk);
+    uint64_t file_size = 0;
+    int status = buffer ? 0 : -1;
+    int copied = 0;
+
+    if (status == 0 && sized && ctx->ring && !ctx->sparse && !input_has_holes(input_fd, &st)) {
+        status = uring_put(ctx, input_fd, st.st_size, &extents);
+        if (status < 0) {
+            fprintf(stderr, "Error: Failed to copy %s into the disk image.\n", file_path);
+        }
+        file_size = st.st_size;
+        copied = 1;
+    }
+
+    while (status == 0 && !copied) {
+        int hole;
+        ssize_t got = read_chunk(input_fd, &st, file_size, buffer, chunk, block_size, &hole);
+        if (got < 0) {
+            perror(file_path);
+            status = -1;
+            break;
+        }
+        if (got == 0) {
+            break;
+        }
+        if (file_size + got > UINT32_MAX) {
+            fprintf(stderr, "Error: %s is too large for the disk image.\n", file_path);
+            status = -1;
+            break;
+        }
+
+        uint32_t blocks_needed = (file_size + got + block_size - 1) / block_size;
+        if (blocks_needed > blocks_allocated) {
+            if (extend_extents(ctx->free_map, &extents, blocks_needed - blocks_allocated) < 0) {
+                fprintf(stderr, "Error: Not enough free blocks available.\n");
+                status = -1;
+                break;
+            }
+            blocks_allocated = blocks_needed;
+        }
+
+        if (store_chunk(ctx, &extents, file_size / block_size, buffer, got, hole) < 0) {
+            fprintf(stderr, "Error: Failed to copy %s into the disk image.\n", file_path);
+            status = -1;
+            break;
+        }
+        file_size += got;
+    }
+
+    if (status == 0 && sized && file_size != (uint64_t)st.st_size) {
+        fprintf(stderr, "Error: %s changed size while it was being copied.\n", file_path);
+        status = -1;
+    }
+    if (!buffer) {
+        perror("Memory allocation failed");
+    }
+
+    if (status == 0) {
+        chain_link(img, &extents);
+        uint32_t first_block = extents.count > 0 ? extents.runs[0].start : FAT_EOF;
+
+        // Add file entry to the directory, now that its size is known
+        struct dir_entry_t new_file = {0};
+        new_file.status = STATUS_FILE;
+        new_file.starting_block = htonl(first_block);
+        new_file.block_count = htonl(blocks_allocated);
+        new_file.file_size = htonl((uint32_t)file_size);
+        set_timestamps(&new_file);
+        strncpy(new_file.filename, filename, 30);
+        new_file.filename[30] = '\0';
+        memcpy(slot, &new_file, sizeof(struct dir_entry_t));
+        image_dirty_range(img, slot, sizeof(struct dir_entry_t));
+        dircache_insert(ctx->dir_cache, dir_start_block, slot);
+    } else {
+        // Nothing points at the blocks yet, so they are simply free again
+        release_extents(ctx->free_map, &extents);
+        release_dir_growth(ctx, dir, dir_start_block, old_block_count, dir_block_count);
+    }
+
+    free(buffer);
+    extent_list_free(&extents);
+    if (input_fd != STDIN_FILENO) {
+        close(input_fd);
+    }
+    return status;
+}
+
+// Function to append count blocks of list, from its block from on, to out
+static int extents_range(const struct extent_list *list, uint32_t from, uint32_t count,
+                         struct extent_list *out) {
+    for (size_t i = 0; i < list->count && count > 0; i++) {
+        if (from >= list->runs[i].count) {
+            from -= list->runs[i].count;
+            continue;
+        }
+        uint32_t n = list->runs[i].count - from < count ? list->runs[i].count - from : count;
+        if (extent_list_add(out, list->runs[i].start + from, n) < 0) {
+            return -1;
+        }
+        count -= n;
+        from = 0;
+    }
+    return 0;
+}
+
+// Where an old block of a file lies, walked forward one block at a time
+struct extent_cursor {
+    size_t run;                 // the run holding the current block,
+    uint32_t run_first;         // and the index in the file of its first block
+};
+
+// Function to find the image block holding the file's block index; indexes
+// must not go backwards
+static uint32_t cursor_block(const struct extent_list *extents, struct extent_cursor *cursor,
+                             uint32_t index) {
+    while (index >= cursor->run_first + extents->runs[cursor->run].count) {
+        cursor->run_first += extents->runs[cursor->run].count;
+        cursor->run++;
+    }
+    return extents->runs[cursor->run].start + (index - cursor->run_first);
+}
+
+// An overwrite in progress: the file's old blocks, which are never written,
+// and its new ones, chosen in order as the data is stored
+struct overwrite {
+    struct extent_list old;
+    uint32_t old_blocks;
+    struct extent_cursor cursor;    // into old
+    struct extent_list blocks;      // the new chain, as far as the data stored so far
+    struct extent_list fresh;       // blocks taken for it, given back if it fails
+    struct extent_list replaced;    // old blocks the new chain leaves out
+};
+
+// Function to store len bytes of new data at the file's block first. Blocks
+// that match the old ones keep them; every other stretch of blocks goes to
+// freshly taken blocks, so the old contents stay whole until the commit
+// switches the chain over.
+static int store_changes(struct put_context *ctx, struct overwrite *ow, uint32_t first,
+                         const uint8_t *buf, size_t len, int zero) {
+    struct disk_image *img = ctx->img;
+    uint16_t block_size = img->sb.block_size;
+    uint32_t count = (len + block_size - 1) / block_size;
+
+    enum block_kind kind = BLOCK_SAME;
+    uint32_t stretch = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        enum block_kind this_kind = BLOCK_SAME;
+        if (i < count) {
+            const uint8_t *p = buf + (size_t)i * block_size;
+            size_t n = i + 1 < count ? block_size : len - (size_t)i * block_size;
+            if (first + i < ow->old_blocks &&
+                memcmp(image_block(img, cursor_block(&ow->old, &ow->cursor, first + i)), p, n) == 0) {
+                this_kind = BLOCK_SAME;
+            } else if (zero || (ctx->sparse && bytes_are_zero(p, n))) {
+                this_kind = BLOCK_ZERO;
+            } else {
+                this_kind = BLOCK_DATA;
+            }
+            if (i > 0 && this_kind == kind) {
+                continue;
+            }
+        }
+
+        uint32_t index = first + stretch;
+        uint32_t n = i - stretch;
+        int status = 0;
+        if (i > 0 && kind == BLOCK_SAME) {
+            status = extents_range(&ow->old, index, n, &ow->blocks);
+        } else if (i > 0) {
+            if (index < ow->old_blocks) {
+                uint32_t old = ow->old_blocks - index < n ? ow->old_blocks - index : n;
+                status = extents_range(&ow->old, index, old, &ow->replaced);
+            }
+            if (status == 0) {
+                status = extend_extents(ctx->free_map, &ow->blocks, n);
+                if (status < 0) {
+                    fprintf(stderr, "Error: Not enough free blocks available.\n");
+                }
+                // Whatever was taken, even short of n, is the overwrite's to give back
+                if (extents_range(&ow->blocks, index, UINT32_MAX, &ow->fresh) < 0) {
+                    status = -1;
+                }
+            }
+            if (status == 0 && kind == BLOCK_DATA) {
+                size_t from = (size_t)stretch * block_size;
+                size_t to = (size_t)i * block_size < len ? (size_t)i * block_size : len;
+                status = write_extents(img, &ow->blocks, index, buf + from, to - from);
+            } else if (status == 0) {
+                status = zero_extents(img, &ow->blocks, index, n);
+            }
+        }
+        if (status < 0) {
+            return -1;
+        }
+        kind = this_kind;
+        stretch = i;
+    }
+    return 0;
+}
+
+// Function to overwrite an existing file. The new content is compared with
+// the old one block at a time; blocks that match stay where they are, and
+// the stretches that differ (or are punched, for zeros in a sparse put) are
+// written to free blocks instead of over the old ones. The chain is then
+// relinked through the new blocks, and the old blocks it leaves out are
+// freed, in the same transaction as the entry, so a crash leaves either the
+// old file or the new one. The freed blocks are not reused until the commit.
+int overwrite_file_entry(struct put_context *ctx, const char *file_path, struct dir_entry_t *entry) {
+    struct disk_image *img = ctx->img;
+    uint16_t block_size = img->sb.block_size;
+    struct overwrite ow = {0};
+    ow.old_blocks = entry_block_count(entry);
+
+    struct stat st;
+    int input_fd = open_input(file_path, &st);
+    if (input_fd < 0) {
+        return -1;
+    }
+
+    // The blocks the file has now, in order
+    uint32_t found = 0;
+    if (ow.old_blocks > 0 && chain_extents(img, entry_start_block(entry), ow.old_blocks, &ow.old) == 0) {
+        for (size_t i = 0; i < ow.old.count; i++) {
+            found += ow.old.runs[i].count;
+        }
+    }
+    if (found != ow.old_blocks) {
+        fprintf(stderr, "Error: The chain of %.*s is damaged; run diskfsck.\n", entry_name_len(entry),
+                entry->filename);
+        extent_list_free(&ow.old);
+        if (input_fd != STDIN_FILENO) {
+            close(input_fd);
+        }
+        return -1;
+    }
+
+    size_t chunk = COPY_CHUNK / block_size * block_size;
+    uint8_t *buffer = malloc(chunk);
+    uint64_t file_size = 0;
+    int status = buffer ? 0 : -1;
+
+    while (status == 0) {
+        int hole;
+        ssize_t got = read_chunk(input_fd, &st, file_size, buffer, chunk, block_size, &hole);
+        if (got < 0) {
+            perror(file_path);
+            status = -1;
+            break;
+        }
+        if (got == 0) {
+            break;
+        }
+        if (file_size + got > UINT32_MAX) {
+            fprintf(stderr, "Error: %s is too large for the disk image.\n", file_path);
+            status = -1;
+            break;
+        }
+
+        if (store_changes(ctx, &ow, file_size / block_size, buffer, got, hole) < 0) {
+            fprintf(stderr, "Error: Failed to copy %s into the disk image.\n", file_path);
+            status = -1;
+            break;
+        }
+        file_size += got;
+    }
+
+    if (status == 0 && S_ISREG(st.st_mode) && file_size != (uint64_t)st.st_size) {
+        fprintf(stderr, "Error: %s changed size while it was being copied.\n", file_path);
+        status = -1;
+    }
+    if (!buffer) {
+        perror("Memory allocation failed");
+    }
+
+    // The old blocks past the new end are left out too; all of them are held
+    // back from reuse until the commit, which is the last thing that can fail
+    uint32_t new_blocks = (file_size + block_size - 1) / block_size;
+    if (status == 0 && new_blocks < ow.old_blocks) {
+        status = extents_range(&ow.old, new_blocks, ow.old_blocks - new_blocks, &ow.replaced);
+    }
+    if (status == 0) {
+        status = freemap_defer(ctx->free_map, &ow.replaced);
+    }
+
+    if (status == 0) {
+        chain_link(img, &ow.blocks);
+        for (size_t i = 0; i < ow.replaced.count; i++) {
+            for (uint32_t block = ow.replaced.runs[i].start;
+                 block < ow.replaced.runs[i].start + ow.replaced.runs[i].count; block++) {
+                fat_set(img, block, FAT_FREE);
+            }
+        }
+
+        entry->starting_block = htonl(new_blocks > 0 ? ow.blocks.runs[0].start : FAT_EOF);
+        entry->block_count = htonl(new_blocks);
+        entry->file_size = htonl((uint32_t)file_size);
+        set_modify_time(entry);
+        image_dirty_range(img, entry, sizeof(*entry));
+    } else {
+        // Nothing points at the new blocks, and the old file is untouched
+        release_extents(ctx->free_map, &ow.fresh);
+    }
+
+    free(buffer);
+    extent_list_free(&ow.old);
+    extent_list_free(&ow.blocks);
+    extent_list_free(&ow.fresh);
+    extent_list_free(&ow.replaced);
+    if (input_fd != STDIN_FILENO) {
+        close(input_fd);
+    }
+    return status;
+}
+
+// Function to walk dest_path, creating missing directories, and add the file
+// at its end
+static int put_path(struct put_context *ctx, const char *file_path, const char *dest_path) {
+    struct disk_image *img = ctx->img;
+
+    // Entries hold at most 30 characters of a name, so a longer one could
+    // never be found again under the name it was put with
+    for (const char *p = dest_path; *p; p++) {
+        size_t len = strcspn(p, "/");
+        if (len > 30) {
+            fprintf(stderr, "Error: The name %.*s is longer than 30 characters.\n", (int)len, p);
+            return -1;
+        }
+        p += len;
+        if (!*p) {
+            break;
+        }
+    }
+
+    char *path_copy = strdup(dest_path);
+    char *token = strtok(path_copy, "/");
+    uint32_t current_start_block = img->sb.root_start;
+    uint32_t current_block_count = img->sb.root_blocks;
+    struct dir_entry_t *current_dir = NULL;
+
+    while (token) {
+        char *next_token = strtok(NULL, "/");
+        if (!next_token) {
+
+            // No more subdirectories; add the file here, or update it in
+            // place if it is already there
+            struct dir_entry_t *existing = dir_lookup(ctx->dir_cache, img, current_start_block,
+                                                      current_block_count, token, ENTRY_FILE);
+            stats_enter(PHASE_COPY);
+            int status;
+            if (!existing && dir_lookup(ctx->dir_cache, img, current_start_block, current_block_count,
+                                        token, ENTRY_DIR)) {
+                fprintf(stderr, "Error: %s is a directory.\n", dest_path);
+                status = -1;
+            } else if (existing) {
+                status = overwrite_file_entry(ctx, file_path, existing);
+            } else {
+                status = add_file_entry(ctx, file_path, token, current_dir,
+                                        current_start_block, current_block_count);
+            }
+
+            free(path_copy);
+            return status;
+        }
+
+        // Traverse or create the subdirectory, but never beside a file of
+        // the same name
+        struct dir_entry_t *entry = dir_lookup(ctx->dir_cache, img, current_start_block,
+                                               current_block_count, token, ENTRY_DIR);
+        if (entry) {
+            current_start_block = entry_start_block(entry);
+            current_block_count = entry_block_count(entry);
+            current_dir = entry;
+        } else if (dir_lookup(ctx->dir_cache, img, current_start_block, current_block_count, token,
+                              ENTRY_FILE)) {
+            fprintf(stderr, "Error: %.*s is not a directory.\n", (int)(token - path_copy + strlen(token)),
+                    dest_path);
+            free(path_copy);
+            return -1;
+        } else {
+            // Create a new subdirectory
+            uint32_t old_block_count = current_block_count;
+            struct dir_entry_t *slot = take_dir_slot(ctx, current_dir, current_start_block,
+                                                     &current_block_count);
+            if (!slot) {
+                fprintf(stderr, "Error: Directory is full.\n");
+                free(path_copy);
+                return -1;
+            }
+
+            // Take a free block for it
+            struct extent_list dir_blocks = {0};
+            if (freemap_alloc(ctx->free_map, 1, &dir_blocks) < 0) {
+                fprintf(stderr, "Error: Not enough free blocks available.\n");
+                extent_list_free(&dir_blocks);
+                release_dir_growth(ctx, current_dir, current_start_block, old_block_count,
+                                   current_block_count);
+                free(path_copy);
+                return -1;
+            }
+            chain_link(img, &dir_blocks);
+            uint32_t new_block = dir_blocks.runs[0].start;
+            extent_list_free(&dir_blocks);
+
+            // Start the new directory out empty
+            memset(image_block(img, new_block), 0, img->sb.block_size);
+            image_mark_dirty(img, new_block);
+
+            // initialize directory entry
+            struct dir_entry_t new_dir = {0};
+            new_dir.status = STATUS_DIRECTORY;
+            new_dir.starting_block = htonl(new_block);
+            new_dir.block_count = htonl(1);
+            strncpy(new_dir.filename, token, 30);
+            new_dir.filename[30] = '\0';
+            set_timestamps(&new_dir);
+
+            // add entry into parent directory
+            memcpy(slot, &new_dir, sizeof(struct dir_entry_t));
+            image_dirty_range(img, slot, sizeof(struct dir_entry_t));
+            dircache_insert(ctx->dir_cache, current_start_block, slot);
+
+            // go into new directory
+            current_start_block = new_block;
+            current_block_count = 1;
+            current_dir = slot;
+        }
+
+        token = next_token;
+    }
+
+    // The destination named no file
+    fprintf(stderr, "Error: Invalid destination path %s.\n", dest_path);
+    free(path_copy);
+    return -1;
+}
+
+int add_file_to_directory(struct put_context *ctx, const char *file_path, const char *dest_path) {
+    enum stats_phase phase = stats_enter(PHASE_RESOLVE);
+    int status = put_path(ctx, file_path, dest_path);
+    stats_enter(phase);
+    return status;
+}
+
+// Function to add every "<host path> <image path>" pair listed in a manifest
+// ("-" for stdin). Pairs are separated by a tab, or by the first space when
+// the line has no tab; blank lines and lines starting with '#' are skipped.
+int add_files_from_manifest(struct put_context *ctx, const char *manifest_path) {
+    FILE *manifest = strcmp(manifest_path, "-") == 0 ? stdin : fopen(manifest_path, "r");
+    if (!manifest) {
+        perror("Error opening manifest");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    unsigned line_number = 0, failures = 0;
+
+    while ((len = getline(&line, &line_size, manifest)) != -1) {
+        line_number++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        char *separator = strchr(line, '\t');
+        if (!separator) {
+            separator = strchr(line, ' ');
+        }
+        if (!separator) {
+            fprintf(stderr, "Error: Manifest line %u has no destination path.\n", line_number);
+            failures++;
+            continue;
+        }
+        *separator = '\0';
+
+        if (add_file_to_directory(ctx, line, separator + 1) < 0) {
+            failures++;
+        } else if (ctx->group_size > 0 && ++ctx->uncommitted >= ctx->group_size &&
+                   put_finish(ctx) < 0) {
+            failures++;
+        }
+    }
+
+    free(line);
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "Error: %u of the manifest entries could not be added.\n", failures);
+        return -1;
+    }
+    return 0;
+}
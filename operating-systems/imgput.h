@@ -0,0 +1,48 @@
+#ifndef IMGPUT_H
+#define IMGPUT_H
+
+#include <stdint.h>
+
+#include "diskimg.h"
+#include "freemap.h"
+#include "dircache.h"
+#include "uring.h"
+
+// Everything a put needs, shared by all the files of a batch
+struct put_context {
+    struct disk_image *img;
+    struct free_map *free_map;
+    struct dir_cache *dir_cache;
+    struct uring *ring;         // copies regular files through io_uring; NULL for read/write
+    int sparse;                 // store all-zero blocks, not just input holes, as image holes
+    unsigned group_size;        // commit a batch every this many files; 0 for once at the end
+    unsigned uncommitted;       // files added since the last commit
+};
+
+// Store the new FAT summary and commit the changed metadata through the
+// journal, so every file added since the last commit becomes durable at once
+int put_finish(struct put_context *ctx);
+
+// Copy a host file ("-" for stdin) to dest_path, creating missing directories
+int add_file_to_directory(struct put_context *ctx, const char *file_path, const char *dest_path);
+
+// Add every "<host path> <image path>" pair listed in a manifest ("-" for stdin)
+int add_files_from_manifest(struct put_context *ctx, const char *manifest_path);
+
+// Add one file to the directory at dir_start_block; dir is the directory's
+// own entry, or NULL for the root
+int add_file_entry(struct put_context *ctx, const char *file_path, const char *filename,
+                   struct dir_entry_t *dir, uint32_t dir_start_block, uint32_t dir_block_count);
+
+// Replace the contents of an existing file, writing only the blocks that
+// change and growing or shrinking its chain at the tail
+int overwrite_file_entry(struct put_context *ctx, const char *file_path, struct dir_entry_t *entry);
+
+// Find an unused entry in a directory, growing it by a block when it is full
+struct dir_entry_t *take_dir_slot(struct put_context *ctx, struct dir_entry_t *dir,
+                                  uint32_t start_block, uint32_t *block_count);
+
+// Stamp an entry with the current time as both create and modify time
+void set_timestamps(struct dir_entry_t *entry);
+
+#endif
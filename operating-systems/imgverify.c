@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "imgverify.h"
+#include "imgget.h"
+#include "stats.h"
+
+// Host data hashed per read
+#define VERIFY_CHUNK (1 << 20)
+
+enum verify_result { VERIFY_SAME, VERIFY_DIFFERS, VERIFY_MISSING, VERIFY_ERROR };
+
+// A file of the image and the host file it is checked against
+struct verify_job {
+    const struct dir_entry_t *entry;
+    char *image_path;
+    char *host_path;
+};
+
+// Work queue shared by the verifying threads
+struct verify_queue {
+    const struct disk_image *img;
+    struct verify_job *jobs;
+    size_t count;
+    size_t capacity;
+    size_t next_job;            // claimed atomically by the workers
+    unsigned mismatches;
+    unsigned failures;
+};
+
+static int queue_push(struct verify_queue *queue, const struct dir_entry_t *entry, char *image_path,
+                      char *host_path) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 256;
+        struct verify_job *jobs = realloc(queue->jobs, capacity * sizeof(struct verify_job));
+        if (!jobs) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        queue->jobs = jobs;
+        queue->capacity = capacity;
+    }
+
+    queue->jobs[queue->count].entry = entry;
+    queue->jobs[queue->count].image_path = image_path;
+    queue->jobs[queue->count].host_path = host_path;
+    queue->count++;
+    return 0;
+}
+
+// Function to join a directory path and an entry's name, allocated
+static char *join_path(const char *dir, const struct dir_entry_t *entry) {
+    size_t path_size = strlen(dir) + 33;
+    char *path = malloc(path_size);
+    if (!path) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    snprintf(path, path_size, "%s/%.*s", strcmp(dir, "/") == 0 ? "" : dir, entry_name_len(entry),
+             entry->filename);
+    return path;
+}
+
+// Function to walk a directory subtree, queueing every file with the host
+// path it should be found at
+static int collect_tree(const struct disk_image *img, uint32_t start_block, uint32_t block_count,
+                        const char *image_dir, const char *host_dir, uint64_t *visited,
+                        struct verify_queue *queue) {
+    // A directory reachable twice means the image has a cycle; walk it once
+    if (start_block < img->size / img->sb.block_size) {
+        if (visited[start_block / 64] >> (start_block % 64) & 1) {
+            return 0;
+        }
+        visited[start_block / 64] |= (uint64_t)1 << (start_block % 64);
+    }
+
+    if (!image_contains(img, start_block, 1)) {
+        fprintf(stderr, "Error: Directory %s lies outside the disk image.\n", image_dir);
+        return -1;
+    }
+
+    struct dir_iter it;
+    const struct dir_entry_t *entry;
+    int status = 0;
+
+    dir_iter_init(&it, img, start_block, block_count);
+    while ((entry = dir_iter_next(&it))) {
+        if (!entry_in_use(entry) || entry_name_eq(entry, ".") || entry_name_eq(entry, "..")) {
+            continue;
+        }
+        if (!entry_name_is_safe(entry)) {
+            fprintf(stderr, "Error: Skipping an entry of %s named \"%.*s\", which is not a valid file name.\n",
+                    image_dir, entry_name_len(entry), entry->filename);
+            status = -1;
+            continue;
+        }
+
+        char *image_path = join_path(image_dir, entry);
+        char *host_path = join_path(host_dir, entry);
+        if (!image_path || !host_path) {
+            free(image_path);
+            free(host_path);
+            return -1;
+        }
+
+        if (entry_is_dir(entry)) {
+            if (collect_tree(img, entry_start_block(entry), entry_block_count(entry), image_path,
+                             host_path, visited, queue) < 0) {
+                status = -1;
+            }
+            free(image_path);
+            free(host_path);
+        } else if (queue_push(queue, entry, image_path, host_path) < 0) {
+            free(image_path);
+            free(host_path);
+            return -1;
+        }
+    }
+    return status;
+}
+
+// Function to compare a host file with a file of the image. Each whole block
+// read from the host is hashed, three at a time, and checked against the
+// image's sum for the block it should match; the host's last, partial block
+// is hashed on through the rest of the image block, as the image's sum
+// covers the whole block.
+static enum verify_result verify_file(const struct disk_image *img, const struct dir_entry_t *entry,
+                                      const char *host_path, uint8_t *buffer, uint32_t *sums) {
+    uint16_t block_size = img->sb.block_size;
+    uint32_t file_size = entry_file_size(entry);
+
+    int fd = open(host_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return VERIFY_MISSING;
+        }
+        perror(host_path);
+        return VERIFY_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(host_path);
+        close(fd);
+        return VERIFY_ERROR;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size != file_size) {
+        close(fd);
+        return VERIFY_DIFFERS;
+    }
+
+    struct extent_list extents = {0};
+    uint32_t blocks_needed = (file_size + block_size - 1) / block_size;
+    if (chain_extents(img, entry_start_block(entry), blocks_needed, &extents) < 0) {
+        fprintf(stderr, "Error: The chain of %s is damaged; run diskfsck.\n", host_path);
+        extent_list_free(&extents);
+        close(fd);
+        return VERIFY_ERROR;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t chunk = VERIFY_CHUNK / block_size * block_size;
+    enum verify_result result = VERIFY_SAME;
+    size_t run = 0;             // the run holding the next block,
+    uint32_t run_left = extents.count ? extents.runs[0].count : 0;  // and how many blocks of it are left
+    uint32_t block = extents.count ? extents.runs[0].start : 0;
+    uint64_t done = 0;
+
+    while (result == VERIFY_SAME && done < file_size) {
+        ssize_t got = read_full(fd, buffer, file_size - done < chunk ? file_size - done : chunk);
+        if (got <= 0) {
+            if (got < 0) {
+                perror(host_path);
+            }
+            result = got < 0 ? VERIFY_ERROR : VERIFY_DIFFERS;     // shrank under us
+            break;
+        }
+
+        uint32_t count = (got + block_size - 1) / block_size;
+        uint32_t whole = got / block_size;
+        crc32c_blocks(buffer, block_size, whole, sums);
+        if (whole < count) {
+            size_t len = got - (size_t)whole * block_size;
+            sums[whole] = crc32c(0, buffer + (size_t)whole * block_size, len);
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            while (run_left == 0) {
+                run++;
+                block = extents.runs[run].start;
+                run_left = extents.runs[run].count;
+            }
+            if (i == whole) {
+                size_t len = got - (size_t)whole * block_size;
+                sums[i] = crc32c(sums[i], image_block(img, block) + len, block_size - len);
+            }
+            if (sums[i] != sums_block(img, block)) {
+                result = VERIFY_DIFFERS;
+                break;
+            }
+            block++;
+            run_left--;
+        }
+        done += got;
+    }
+
+    extent_list_free(&extents);
+    close(fd);
+    return result;
+}
+
+static void *verify_worker(void *arg) {
+    struct verify_queue *queue = arg;
+    size_t chunk = VERIFY_CHUNK / queue->img->sb.block_size * queue->img->sb.block_size;
+    uint8_t *buffer = malloc(chunk);
+    uint32_t *sums = malloc((chunk / queue->img->sb.block_size + 1) * sizeof(uint32_t));
+    for (;;) {
+        size_t job = __atomic_fetch_add(&queue->next_job, 1, __ATOMIC_RELAXED);
+        if (job >= queue->count) {
+            break;
+        }
+        if (!buffer || !sums) {
+            __atomic_fetch_add(&queue->failures, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        switch (verify_file(queue->img, queue->jobs[job].entry, queue->jobs[job].host_path, buffer, sums)) {
+        case VERIFY_SAME:
+            break;
+        case VERIFY_DIFFERS:
+            printf("Differs: %s\n", queue->jobs[job].image_path);
+            __atomic_fetch_add(&queue->mismatches, 1, __ATOMIC_RELAXED);
+            break;
+        case VERIFY_MISSING:
+            printf("Missing: %s\n", queue->jobs[job].image_path);
+            __atomic_fetch_add(&queue->mismatches, 1, __ATOMIC_RELAXED);
+            break;
+        case VERIFY_ERROR:
+            __atomic_fetch_add(&queue->failures, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    if (!buffer || !sums) {
+        perror("Memory allocation failed");
+    }
+    free(buffer);
+    free(sums);
+    return NULL;
+}
+
+// Function to queue the file or subtree at image_path and check it
+static int verify_subtree(const struct disk_image *img, const char *image_path, const char *host_path,
+                          int workers) {
+    struct verify_queue queue = {0};
+    queue.img = img;
+    int status = 0;
+
+    const struct dir_entry_t *entry = NULL;
+    if (strcmp(image_path, "/") != 0) {
+        entry = find_file(img, image_path);
+        if (!entry) {
+            fprintf(stderr, "File not found.\n");
+            return -1;
+        }
+    }
+
+    if (entry && !entry_is_dir(entry)) {
+        char *image_copy = strdup(image_path);
+        char *host_copy = strdup(host_path);
+        if (!image_copy || !host_copy || queue_push(&queue, entry, image_copy, host_copy) < 0) {
+            free(image_copy);
+            free(host_copy);
+            return -1;
+        }
+    } else {
+        // Walk the tree first; the directory structure is tiny next to the data
+        uint64_t *visited = calloc((img->size / img->sb.block_size) / 64 + 1, sizeof(uint64_t));
+        if (!visited) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        status = collect_tree(img, entry ? entry_start_block(entry) : img->sb.root_start,
+                              entry ? entry_block_count(entry) : img->sb.root_blocks,
+                              strcmp(image_path, "/") == 0 ? "/" : image_path, host_path, visited, &queue);
+        free(visited);
+    }
+
+    if ((size_t)workers > queue.count) {
+        workers = queue.count ? queue.count : 1;
+    }
+
+    // The calling thread is one of the workers
+    stats_enter(PHASE_COPY);
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 1; threads && i < workers; i++) {
+        if (pthread_create(&threads[started], NULL, verify_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+    verify_worker(&queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (queue.failures > 0) {
+        fprintf(stderr, "Error: %u files could not be checked.\n", queue.failures);
+        status = -1;
+    }
+    if (status == 0) {
+        if (queue.mismatches == 0) {
+            printf("Verified %zu files: all match.\n", queue.count);
+        } else {
+            printf("Verified %zu files: %u differ.\n", queue.count, queue.mismatches);
+        }
+    }
+
+    for (size_t i = 0; i < queue.count; i++) {
+        free(queue.jobs[i].image_path);
+        free(queue.jobs[i].host_path);
+    }
+    free(queue.jobs);
+    return status < 0 ? -1 : (int)queue.mismatches;
+}
+
+int verify_path(const struct disk_image *img, const char *image_path, const char *host_path, int workers) {
+    if (img->sums.map && img->sums.stale) {
+        fprintf(stderr, "Warning: The checksum index %s is out of date; reading the image instead. "
+                "Rebuild it with diskverify -b.\n", img->sums.path);
+    }
+
+    enum stats_phase phase = stats_enter(PHASE_RESOLVE);
+    int status = verify_subtree(img, image_path, host_path, workers);
+    stats_enter(phase);
+    return status;
+}
@@ -0,0 +1,15 @@
+#ifndef IMGVERIFY_H
+#define IMGVERIFY_H
+
+#include "diskimg.h"
+
+// Check the host file or directory tree at host_path against the file or
+// directory at image_path, printing every file that differs from the image
+// or is missing on the host. Only the host side is read: each of its blocks
+// is hashed and compared with the image's checksum index, or with a hash of
+// the image block when the image has no usable index. Files are checked
+// concurrently by up to workers threads. Returns the number of files that
+// differ or are missing, or -1 on error.
+int verify_path(const struct disk_image *img, const char *image_path, const char *host_path, int workers);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "journal.h"
+#include "stats.h"
+
+// FNV-1a, continued from hash over another len bytes
+static uint32_t journal_hash(uint32_t hash, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline int block_dirty(const struct disk_image *img, uint32_t block) {
+    return img->dirty[block / 64] >> (block % 64) & 1;
+}
+
+// Function to make the creation of the journal itself durable
+static int sync_parent(const char *path) {
+    char *copy = strdup(path);
+    if (!copy) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    int dir = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (dir < 0) {
+        perror("Error opening the journal's directory");
+        return -1;
+    }
+    int status = fsync(dir);
+    if (status < 0) {
+        perror("Error syncing the journal's directory");
+    }
+    close(dir);
+    return status;
+}
+
+// Function to log the dirty metadata blocks to the journal and sync it
+static int journal_write(struct disk_image *img, const uint32_t *blocks, uint32_t count) {
+    uint16_t block_size = img->sb.block_size;
+    uint32_t *list = malloc((size_t)count * sizeof(uint32_t));
+    if (!list) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    uint32_t check = 2166136261u;
+    for (uint32_t i = 0; i < count; i++) {
+        list[i] = htonl(blocks[i]);
+    }
+    check = journal_hash(check, list, (size_t)count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        check = journal_hash(check, image_block(img, blocks[i]), block_size);
+    }
+
+    struct journal_header header = {
+        htonl(JOURNAL_MAGIC), htonl(block_size), htonl(count), htonl(check)
+    };
+
+    int fd = open(img->journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Error creating journal");
+        free(list);
+        return -1;
+    }
+
+    int status = write_full(fd, &header, sizeof(header));
+    if (status == 0) {
+        status = write_full(fd, list, (size_t)count * sizeof(uint32_t));
+    }
+
+    // Neighbouring blocks go out in one write, as image_flush does
+    for (uint32_t i = 0; i < count && status == 0;) {
+        uint32_t run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run) {
+            run++;
+        }
+        status = write_full(fd, image_block(img, blocks[i]), (size_t)run * block_size);
+        i += run;
+    }
+
+    if (status == 0 && fdatasync(fd) < 0) {
+        perror("Error syncing journal");
+        status = -1;
+    }
+    close(fd);
+    free(list);
+
+    if (status == 0) {
+        status = sync_parent(img->journal_path);
+    }
+    return status;
+}
+
+// Function to commit the dirty metadata of an image through the journal
+static int commit(struct disk_image *img) {
+    if (!img->dirty || !img->journal_path) {
+        return 0;
+    }
+
+    uint32_t nblocks = img->size / img->sb.block_size;
+    uint32_t count = 0;
+    for (uint32_t block = 0; block < nblocks; block++) {
+        if (block % 64 == 0 && img->dirty[block / 64] == 0) {
+            block += 63;
+            continue;
+        }
+        count += block_dirty(img, block);
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint32_t *blocks = malloc((size_t)count * sizeof(uint32_t));
+    if (!blocks) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    uint32_t n = 0;
+    for (uint32_t block = 0; block < nblocks && n < count; block++) {
+        if (block % 64 == 0 && img->dirty[block / 64] == 0) {
+            block += 63;
+            continue;
+        }
+        if (block_dirty(img, block)) {
+            blocks[n++] = block;
+        }
+    }
+
+    // File data was written straight to the image; it must be on disk before
+    // any metadata that points at it
+    if (fdatasync(img->fd) < 0) {
+        perror("Error syncing disk image");
+        free(blocks);
+        return -1;
+    }
+
+    if (journal_write(img, blocks, count) < 0) {
+        // Nothing of this group reached the image; the journal, if any part
+        // of it was written, fails its check and is discarded on the next open
+        unlink(img->journal_path);
+        free(blocks);
+        return -1;
+    }
+    free(blocks);
+
+    // Checkpoint: the journal now covers a crash during the in-place writes
+    if (image_flush(img) < 0) {
+        return -1;
+    }
+    if (fdatasync(img->fd) < 0) {
+        perror("Error syncing disk image");
+        return -1;
+    }
+    if (unlink(img->journal_path) < 0) {
+        perror("Error removing journal");
+        return -1;
+    }
+    return 0;
+}
+
+int journal_commit(struct disk_image *img) {
+    enum stats_phase phase = stats_enter(PHASE_FLUSH);
+    int status = commit(img);
+    if (status == 0) {
+        status = sums_commit(img);
+    }
+    stats_enter(phase);
+    return status;
+}
+
+// Function to check a journal read into memory; returns the number of blocks
+// it holds, or -1 if it never finished committing
+static int64_t journal_valid(const uint8_t *data, size_t len, size_t image_size) {
+    struct journal_header header;
+    if (len < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    uint32_t block_size = ntohl(header.block_size);
+    uint32_t count = ntohl(header.count);
+    if (ntohl(header.magic) != JOURNAL_MAGIC || block_size == 0 ||
+        len != sizeof(header) + (uint64_t)count * (sizeof(uint32_t) + block_size)) {
+        return -1;
+    }
+
+    const uint8_t *body = data + sizeof(header);
+    if (journal_hash(2166136261u, body, len - sizeof(header)) != ntohl(header.check)) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t block;
+        memcpy(&block, body + (size_t)i * sizeof(uint32_t), sizeof(uint32_t));
+        if (((uint64_t)ntohl(block) + 1) * block_size > image_size) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// Function to name the journal of the image at image_path
+char *journal_name(const char *image_path) {
+    size_t len = strlen(image_path);
+    char *journal_path = malloc(len + sizeof(JOURNAL_SUFFIX));
+    if (!journal_path) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    memcpy(journal_path, image_path, len);
+    memcpy(journal_path + len, JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+    return journal_path;
+}
+
+// Function to replay a journal left behind by an interrupted commit
+int journal_recover(const char *image_path, const char *journal_path, int image_fd, size_t image_size) {
+    int fd = open(journal_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    uint8_t *data = NULL;
+    int64_t count = -1;
+    if (fstat(fd, &st) == 0 && (data = malloc(st.st_size ? st.st_size : 1)) &&
+        read_full(fd, data, st.st_size) == st.st_size) {
+        count = journal_valid(data, st.st_size, image_size);
+    }
+    close(fd);
+
+    if (count < 0) {
+        // Torn while being written: the image never saw any of it
+        unlink(journal_path);
+        free(data);
+        return 0;
+    }
+
+    int own_fd = image_fd < 0;
+    if (own_fd && (image_fd = open(image_path, O_RDWR | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Warning: %s has a journal to replay, but cannot be opened for writing.\n",
+                image_path);
+        free(data);
+        return 0;
+    }
+
+    struct journal_header header;
+    memcpy(&header, data, sizeof(header));
+    uint32_t block_size = ntohl(header.block_size);
+    const uint8_t *list = data + sizeof(header);
+    const uint8_t *blocks = list + (size_t)count * sizeof(uint32_t);
+
+    int status = 0;
+    for (int64_t i = 0; i < count && status == 0; i++) {
+        uint32_t block;
+        memcpy(&block, list + (size_t)i * sizeof(uint32_t), sizeof(uint32_t));
+        if (pwrite(image_fd, blocks + (size_t)i * block_size, block_size,
+                   (off_t)ntohl(block) * block_size) != (ssize_t)block_size) {
+            perror("Error replaying journal");
+            status = -1;
+        }
+    }
+    if (status == 0 && fdatasync(image_fd) < 0) {
+        perror("Error syncing disk image");
+        status = -1;
+    }
+    if (status == 0) {
+        unlink(journal_path);
+    }
+
+    if (own_fd) {
+        close(image_fd);
+    }
+    free(data);
+    return status;
+}
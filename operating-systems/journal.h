@@ -0,0 +1,45 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "diskimg.h"
+
+// Metadata journal, kept next to the image as <image>.journal while a commit
+// is in progress. A commit makes every FAT and directory change since the
+// last one durable at once:
+//   1. fdatasync the image, so file data lands before anything points at it
+//   2. write the dirty metadata blocks to the journal and fdatasync it
+//   3. write them in place and fdatasync the image
+//   4. remove the journal
+// A crash before step 2 completes loses the whole group and leaves the image
+// as it was; a crash after it is repaired by replaying the journal the next
+// time the image is opened.
+
+#define JOURNAL_MAGIC  0x4A524E4C  // "JRNL"
+#define JOURNAL_SUFFIX ".journal"
+
+// All fields are big-endian. The header is followed by count block numbers
+// and then the count blocks themselves; check is FNV-1a over both.
+struct __attribute__((packed)) journal_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t count;
+    uint32_t check;
+};
+
+// Commit the image's dirty metadata through the journal
+int journal_commit(struct disk_image *img);
+
+// Returns <image_path>.journal, allocated
+char *journal_name(const char *image_path);
+
+// Replay the committed journal at journal_path, left by a crash, into the
+// image at image_path, then remove it. image_fd is the image opened for
+// writing, or -1 to have the image opened just for the replay. A journal
+// that never finished committing is discarded. Returns -1 if a committed
+// journal could not be replayed.
+int journal_recover(const char *image_path, const char *journal_path, int image_fd, size_t image_size);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct io_stats io_stats;
+
+// Set in the thread that enabled stats, the only one that keeps phase time
+static __thread int timing_thread;
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "other", "superblock", "fat", "resolve", "copy", "flush"
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+int stats_enable(const char *format) {
+    enum stats_format chosen;
+    if (!format || strcmp(format, "text") == 0) {
+        chosen = STATS_TEXT;
+    } else if (strcmp(format, "json") == 0) {
+        chosen = STATS_JSON;
+    } else {
+        fprintf(stderr, "Error: Unknown stats format %s.\n", format);
+        return -1;
+    }
+
+    memset(&io_stats, 0, sizeof(io_stats));
+    io_stats.next_offset = UINT64_MAX;
+    io_stats.phase = PHASE_OTHER;
+    io_stats.start_ns = io_stats.phase_start_ns = now_ns();
+    io_stats.format = chosen;
+    timing_thread = 1;
+    return 0;
+}
+
+enum stats_phase stats_enter(enum stats_phase phase) {
+    enum stats_phase previous = io_stats.phase;
+    if (io_stats.format && timing_thread && phase != previous) {
+        uint64_t now = now_ns();
+        io_stats.phase_ns[previous] += now - io_stats.phase_start_ns;
+        io_stats.phase_start_ns = now;
+        io_stats.phase = phase;
+    }
+    return previous;
+}
+
+// Function to print the collected stats and stop collecting
+void stats_report(const char *tool) {
+    if (!io_stats.format || !timing_thread) {
+        return;
+    }
+    stats_enter(PHASE_OTHER);
+    double total_ms = (now_ns() - io_stats.start_ns) / 1e6;
+
+    if (io_stats.format == STATS_JSON) {
+        fprintf(stderr, "{\"tool\":\"%s\",\"total_ms\":%.3f,\"phases_ms\":{", tool, total_ms);
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            fprintf(stderr, "%s\"%s\":%.3f", i ? "," : "", phase_names[i], io_stats.phase_ns[i] / 1e6);
+        }
+        fprintf(stderr, "},\"read_calls\":%llu,\"write_calls\":%llu,\"bytes_read\":%llu,"
+                "\"bytes_written\":%llu,\"seeks\":%llu,\"fat_entries\":%llu}\n",
+                (unsigned long long)io_stats.read_calls, (unsigned long long)io_stats.write_calls,
+                (unsigned long long)io_stats.bytes_read, (unsigned long long)io_stats.bytes_written,
+                (unsigned long long)io_stats.seeks, (unsigned long long)io_stats.fat_entries);
+    } else {
+        fprintf(stderr, "%s stats:\n", tool);
+        for (int i = 1; i < PHASE_COUNT; i++) {
+            fprintf(stderr, "  %-14s %10.3f ms\n", phase_names[i], io_stats.phase_ns[i] / 1e6);
+        }
+        fprintf(stderr, "  %-14s %10.3f ms\n", phase_names[0], io_stats.phase_ns[0] / 1e6);
+        fprintf(stderr, "  %-14s %10.3f ms\n", "total", total_ms);
+        fprintf(stderr, "  %-14s %10llu (%llu bytes)\n", "read calls",
+                (unsigned long long)io_stats.read_calls, (unsigned long long)io_stats.bytes_read);
+        fprintf(stderr, "  %-14s %10llu (%llu bytes)\n", "write calls",
+                (unsigned long long)io_stats.write_calls, (unsigned long long)io_stats.bytes_written);
+        fprintf(stderr, "  %-14s %10llu\n", "seeks", (unsigned long long)io_stats.seeks);
+        fprintf(stderr, "  %-14s %10llu\n", "FAT entries", (unsigned long long)io_stats.fat_entries);
+    }
+
+    io_stats.format = STATS_OFF;
+    timing_thread = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Optional instrumentation behind --stats: wall time per phase and counts of
+// the I/O done, kept in one global record and reported on stderr when the
+// operation ends. Every hook returns at once while stats are off.
+
+enum stats_phase {
+    PHASE_OTHER,        // argument handling, output formatting, anything unclaimed
+    PHASE_SUPERBLOCK,   // opening and mapping the image, replaying its journal
+    PHASE_FAT,          // scanning the FAT or following chains through it
+    PHASE_RESOLVE,      // walking directories to find paths
+    PHASE_COPY,         // moving file data in or out
+    PHASE_FLUSH,        // committing changed metadata
+    PHASE_COUNT
+};
+
+enum stats_format { STATS_OFF, STATS_TEXT, STATS_JSON };
+
+struct io_stats {
+    enum stats_format format;
+    enum stats_phase phase;
+    uint64_t start_ns;
+    uint64_t phase_start_ns;
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t seeks;             // image accesses that did not follow on from the last one
+    uint64_t fat_entries;       // FAT entries read
+    uint64_t next_offset;       // image offset just past the last access
+};
+
+extern struct io_stats io_stats;
+
+// getopt_long entry for --stats[=text|json]; its value is STATS_OPTION
+#define STATS_OPTION      0x100
+#define STATS_LONG_OPTION { "stats", optional_argument, NULL, STATS_OPTION }
+
+// Start collecting; format is NULL or "text" for a table, "json" for one line
+// of JSON. Returns -1 for an unknown format.
+int stats_enable(const char *format);
+
+// Print what was collected to stderr under the tool's name, then stop
+void stats_report(const char *tool);
+
+// Switch the calling thread's time to phase and return the phase it was in,
+// to be restored with another stats_enter. Only the thread that enabled
+// stats keeps time; calls from worker threads do nothing.
+enum stats_phase stats_enter(enum stats_phase phase);
+
+static inline void stats_read(size_t bytes) {
+    if (io_stats.format) {
+        __atomic_fetch_add(&io_stats.read_calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&io_stats.bytes_read, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void stats_write(size_t bytes) {
+    if (io_stats.format) {
+        __atomic_fetch_add(&io_stats.write_calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&io_stats.bytes_written, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void stats_fat(uint64_t entries) {
+    if (io_stats.format) {
+        __atomic_fetch_add(&io_stats.fat_entries, entries, __ATOMIC_RELAXED);
+    }
+}
+
+// Record an access to len bytes of the image at offset
+static inline void stats_access(off_t offset, size_t len) {
+    if (io_stats.format) {
+        if ((uint64_t)offset != __atomic_load_n(&io_stats.next_offset, __ATOMIC_RELAXED)) {
+            __atomic_fetch_add(&io_stats.seeks, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&io_stats.next_offset, (uint64_t)offset + len, __ATOMIC_RELAXED);
+    }
+}
+
+#endif
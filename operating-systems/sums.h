@@ -0,0 +1,82 @@
+#ifndef SUMS_H
+#define SUMS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Checksum index, kept next to the image as <image>.sums once it has been
+// built with diskverify -b: the CRC32C of every block of the image, so that a
+// host file can be checked against the image by hashing the host copy alone.
+// Every write of file data updates it. The header is marked dirty, and synced,
+// before the first write after a commit and marked clean again once the
+// commit is durable, so an index that may have missed a write (a crash, or a
+// tool that could not open it) is never trusted; building it again fixes it.
+
+#define SUMS_MAGIC  0x4353554D  // "CSUM"
+#define SUMS_SUFFIX ".sums"
+
+enum sums_state { SUMS_CLEAN, SUMS_DIRTY };
+
+// All fields are big-endian. The header is followed by block_count CRC32Cs,
+// one per block of the image.
+struct __attribute__((packed)) sums_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t state;
+};
+
+struct block_sums {
+    char *path;             // <image>.sums
+    uint8_t *map;           // the whole index, or NULL when there is none
+    size_t size;
+    uint32_t *sums;         // big-endian, inside the mapping
+    uint32_t block_count;
+    uint32_t zero_sum;      // of a block of zeros, as a hole reads
+    int writable;
+    int stale;              // dirty when opened: neither trusted nor kept up to date
+    int changed;            // marked dirty since the last commit
+};
+
+struct disk_image;
+
+// CRC32C (Castagnoli) of len bytes, continuing from crc (0 to start). Uses
+// the SSE4.2 crc32 instruction where the CPU has it.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// CRC32C of each of count consecutive blocks of block_size bytes, hashing
+// three blocks at a time side by side where the CPU can
+void crc32c_blocks(const uint8_t *buf, size_t block_size, size_t count, uint32_t *out);
+
+// Load <path>.sums into img->sums if it exists and matches the image. A
+// missing index is not an error, and an unusable one is only warned about.
+void sums_open(struct disk_image *img, const char *path);
+
+// Unmap the index
+void sums_close(struct disk_image *img);
+
+// Mark the index dirty ahead of a write of file data
+void sums_dirty(struct disk_image *img);
+
+// Record the new contents of len bytes just written to the image file at
+// offset; a NULL buf stands for zeros
+void sums_update(struct disk_image *img, off_t offset, const void *buf, size_t len);
+
+// Once a commit has made the image durable: sync the index and mark it clean
+int sums_commit(struct disk_image *img);
+
+// Whether img->sums can stand in for the image's blocks
+static inline int sums_usable(const struct block_sums *sums) {
+    return sums->map && !sums->stale;
+}
+
+// Returns the CRC32C of block, from the index when it is usable and by
+// hashing the block in the image otherwise
+uint32_t sums_block(const struct disk_image *img, uint32_t block);
+
+// Hash every block of the image, with up to workers threads, into a new
+// index that replaces any old one, and load it
+int sums_build(struct disk_image *img, int workers);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "stats.h"
+
+// One buffer's progress through its read and then its write
+struct copy_slot {
+    uint8_t *buf;
+    off_t src_offset;
+    off_t dst_offset;
+    size_t len;
+    size_t done;        // bytes of the current operation completed so far
+    int writing;
+    int busy;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Function to map the rings of a new io_uring instance
+int uring_init(struct uring *ring, unsigned depth) {
+    memset(ring, 0, sizeof(*ring));
+
+    struct io_uring_params p = {0};
+    ring->fd = sys_io_uring_setup(depth, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->depth = depth;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+
+    if (ring->cq_ring_size == 0) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_exit(ring);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_exit(struct uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Function to queue the next read or write of a slot
+static void queue_slot(struct uring *ring, struct copy_slot *slot, size_t index, int in_fd, int out_fd) {
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = slot->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = slot->writing ? out_fd : in_fd;
+    sqe->off = (slot->writing ? slot->dst_offset : slot->src_offset) + slot->done;
+    sqe->addr = (uintptr_t)(slot->buf + slot->done);
+    sqe->len = slot->len - slot->done;
+    sqe->user_data = index;
+
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Function to copy segments between two fds with overlapped reads and writes
+int uring_copy(struct uring *ring, int in_fd, int out_fd, const struct copy_segment *segs,
+               size_t count, size_t chunk, copy_written_fn written, void *arg) {
+    struct copy_slot *slots = calloc(ring->depth, sizeof(struct copy_slot));
+    if (!slots) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    size_t seg = 0, seg_done = 0;   // next piece to read
+    unsigned busy = 0, to_submit = 0;
+    int status = 0;
+
+    for (;;) {
+        // Start a read in every idle slot while there is data left
+        for (size_t i = 0; i < ring->depth && status == 0 && seg < count; i++) {
+            struct copy_slot *slot = &slots[i];
+            if (slot->busy) {
+                continue;
+            }
+            if (!slot->buf && !(slot->buf = malloc(chunk))) {
+                perror("Memory allocation failed");
+                status = -1;
+                break;
+            }
+
+            size_t len = segs[seg].len - seg_done;
+            slot->len = len < chunk ? len : chunk;
+            slot->src_offset = segs[seg].src_offset + seg_done;
+            slot->dst_offset = segs[seg].dst_offset + seg_done;
+            slot->done = 0;
+            slot->writing = 0;
+            slot->busy = 1;
+            queue_slot(ring, slot, i, in_fd, out_fd);
+            busy++;
+            to_submit++;
+
+            seg_done += slot->len;
+            if (seg_done == segs[seg].len) {
+                seg++;
+                seg_done = 0;
+            }
+        }
+
+        if (busy == 0) {
+            break;
+        }
+
+        int entered = sys_io_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (entered < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter");
+            status = -1;
+            if (to_submit > 0) {
+                // The kernel is refusing new work; stop waiting for it
+                break;
+            }
+        } else {
+            to_submit -= entered < (int)to_submit ? entered : (int)to_submit;
+        }
+
+        // Reap completions: a finished read becomes a write, a finished write
+        // frees its slot; short transfers are resumed where they stopped
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            struct copy_slot *slot = &slots[cqe->user_data];
+
+            if (cqe->res <= 0 || status < 0) {
+                if (cqe->res < 0 && status == 0) {
+                    errno = -cqe->res;
+                    perror(slot->writing ? "Error writing" : "Error reading");
+                } else if (cqe->res == 0 && status == 0) {
+                    fprintf(stderr, "Error: Input ended early.\n");
+                }
+                status = -1;
+                slot->busy = 0;
+                busy--;
+                continue;
+            }
+
+            if (slot->writing) {
+                stats_write(cqe->res);
+            } else {
+                stats_read(cqe->res);
+            }
+            slot->done += cqe->res;
+            if (slot->done < slot->len) {
+                queue_slot(ring, slot, cqe->user_data, in_fd, out_fd);
+                to_submit++;
+            } else if (!slot->writing) {
+                slot->writing = 1;
+                slot->done = 0;
+                queue_slot(ring, slot, cqe->user_data, in_fd, out_fd);
+                to_submit++;
+            } else {
+                if (written) {
+                    written(arg, slot->dst_offset, slot->buf, slot->len);
+                }
+                slot->busy = 0;
+                busy--;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // Buffers the kernel may still be using are left alone rather than freed
+    for (size_t i = 0; i < ring->depth; i++) {
+        if (!slots[i].busy) {
+            free(slots[i].buf);
+        }
+    }
+    if (busy == 0) {
+        free(slots);
+    }
+    return status;
+}
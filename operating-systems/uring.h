@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A minimal io_uring, driven through the raw system calls and the kernel's
+// own header, for the bulk copy paths of diskget and diskput. Only reads and
+// writes at explicit offsets are used.
+struct uring {
+    int fd;
+    unsigned depth;
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// Size of each buffer in flight
+#define URING_CHUNK (256 << 10)
+
+// len bytes at src_offset in the source go to dst_offset in the destination
+struct copy_segment {
+    off_t src_offset;
+    off_t dst_offset;
+    size_t len;
+};
+
+// Called with each chunk once it has been written
+typedef void (*copy_written_fn)(void *arg, off_t dst_offset, const void *buf, size_t len);
+
+// Set up a ring for depth operations in flight; returns -1 when the kernel
+// has no io_uring (or it is disabled), in which case the caller falls back
+// to pread/pwrite
+int uring_init(struct uring *ring, unsigned depth);
+void uring_exit(struct uring *ring);
+
+// Copy every segment from in_fd to out_fd in chunks of at most chunk bytes,
+// with up to depth chunks in flight: each is read into its own buffer and
+// written as soon as its read completes, so reads of later chunks overlap
+// writes of earlier ones. Returns -1 on any error, once nothing is in flight.
+int uring_copy(struct uring *ring, int in_fd, int out_fd, const struct copy_segment *segs,
+               size_t count, size_t chunk, copy_written_fn written, void *arg);
+
+#endif